@@ -1,13 +1,137 @@
-﻿#include <windows.h>
+﻿#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <io.h>
+#include <mmsystem.h>
+#include <cfgmgr32.h>
+#include <bcrypt.h>
 
 #define RING_BUFFER_SIZE 8192
 #define MAX_PACKET_SIZE 8192
 #define MAX_RESPONSE_SIZE 8192
 #define MAX_OFFSET_RETRIES 5
+#define HTTPREAD_STALL_TIMEOUT_MS 30000
+#define ARENA_BLOCK_SIZE 16384  // fits one AT+HTTPREAD chunk (10240) with room to spare
+#define ARENA_BLOCKS 4
+#define RX_READ_MAX 256         // largest single ReadFile into the ring
+#define AT_MAX_FRAGS 8
+#define AT_INLINE_BYTES 256     // longer commands are assembled in a session block
+#define SIM_COMMAND_LATENCY_MS 20  // simulated module turnaround per AT+HTTPREAD
+#define HTTPREAD_DEFAULT_SIZE 10240
+#define LOW_LATENCY_READ_WAIT_MS 100    // idle read completion in the low-latency profile
+#define FTDI_LOW_LATENCY_MS 1
+#define PACE_MIN_BLOCK 256         // smallest paced LFOTA write
+#define PACE_BLOCKS_PER_S 50        // paced blocks carry ~20 ms of data
+#define PACE_BACKOFF_PCT 70         // pace kept after an upload loses data
+#define PACE_MIN_BPS 960            // back-off floor, bytes/s (the wire rate at 9600 baud)
+#define PACE_PROBE_PCT 105          // next run probes this far above the learned pace
+#define PACE_MAX_ATTEMPTS 3
+#define RECONNECT_POLL_MS 20        // reopen attempts while a vanished port is away
+#define RECONNECT_PROBE_MS 1000     // a new port that did not answer AT is probed again after this
+#define PORT_IDENTIFY_MS 500        // time a candidate port gets to answer AT+CGSN
+#define SERIAL_MAX_PORTS 64
+#define WATCH_MAX_UNITS 16          // modules `watch` updates at the same time (worker threads)
+#define WATCH_MAX_TASKS 64          // ports probed or queued for an update at once
+#define WATCH_PROBE_MS 10000        // time a new port gets to answer AT before it is ignored
+#define WATCH_DONE_MAX 1024         // updated IMEIs remembered; the least recently seen is forgotten first
+#define WATCH_POLL_MS 500           // port scan interval without arrival notifications
+#define WATCH_IDLE_MS 100           // worker nap when there is nothing to run or steal
+#define FLEET_START_LIMIT 2         // phases a shared resource admits before anything is measured
+#define FLEET_GAIN_PCT 10           // one more holder must add this much aggregate throughput
+#define FLEET_MIN_SAMPLE_MS 500     // shorter holds are too noisy to learn from
+#define READY_PROBE_MS 250          // AT probe interval while waiting for a rebooted module
+#define CFOTA_READY_GRACE_MS 3000   // wait for QCRDY this long after a reopen before probing
+#define POST_UPDATE_READY_MS 10000
+#define NET_MAX_LINKS 16
+#define NET_SOCKET_BUFFER (512 * 1024)  // send/receive buffers for network ports
+#define TUNE_SAMPLE_BYTES (256 * 1024)  // body bytes read per tuning trial
+#define TUNE_MAX_BAUDS 8
+#define BATCH_MAX_ITEMS 1024
+#define JOB_MAX_DEVICES 64
+#define JOB_COMPACT_RECORDS 256         // appended lines before the job log is rewritten
+#define JOB_CHECKPOINT_BYTES (256 * 1024) // transfer progress between durable offsets
+#define TW_LEVELS 4
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TRACE_MAX_EVENTS 1000000
+#define METRICS_MAX_DEVICES 64
+#define METRICS_MAX_SLOTS 8
+#define METRICS_JSON_INTERVAL_MS 1000
+#define ALOG_RING_RECORDS 4096      // per producer thread, power of two
+#define ALOG_MAX_THREADS 16
+#define ALOG_TEXT_BYTES 48                  // inline in a record; longer text chains on
+#define ALOG_MAX_TEXT 1024                  // longest text kept, beyond it counted as truncated
+#define PROGRESS_TTY_INTERVAL_US 250000     // status line redraw on a console
+#define PROGRESS_PIPE_INTERVAL_US 2000000   // JSON progress lines when redirected
+#define PROGRESS_EWMA_ALPHA 0.3
+#define REPORT_MAX_STEPS 128
+#define REPORT_MAX_CFOTA_EVENTS 128
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "advapi32.lib")
+#pragma comment(lib, "bcrypt.lib")
+
+// Static probes on protocol and data-path events. They cost a predictable
+// branch when nothing is listening:
+//  - Windows: ETW TraceLogging provider "SIMCom.HttpTool" (capture with WPR,
+//    `tracelog`/`xperf` or `logman` using the provider name).
+//  - Linux with <sys/sdt.h>: USDT probes in provider "simcom" for
+//    bpftrace/perf/SystemTap (e.g. `bpftrace -e 'usdt:./tool:simcom:ring_full {...}'`).
+#if defined(_WIN32)
+#include <TraceLoggingProvider.h>
+// {6B1F5C3E-2A0D-4E57-9B8C-3F4D1A7E9C21}
+TRACELOGGING_DEFINE_PROVIDER(g_probe_provider, "SIMCom.HttpTool",
+    (0x6b1f5c3e, 0x2a0d, 0x4e57, 0x9b, 0x8c, 0x3f, 0x4d, 0x1a, 0x7e, 0x9c, 0x21));
+#define PROBES_REGISTER() TraceLoggingRegister(g_probe_provider)
+#define PROBES_UNREGISTER() TraceLoggingUnregister(g_probe_provider)
+#define PROBE_COMMAND_SENT(cmd) \
+    TraceLoggingWrite(g_probe_provider, "CommandSent", TraceLoggingString(cmd, "command"))
+#define PROBE_LINE_RECEIVED(line, len) \
+    TraceLoggingWrite(g_probe_provider, "LineReceived", TraceLoggingCountedString(line, (USHORT)(len), "line"))
+#define PROBE_CHUNK_START(offset, len) \
+    TraceLoggingWrite(g_probe_provider, "ChunkStart", TraceLoggingInt64(offset, "offset"), TraceLoggingInt32(len, "length"))
+#define PROBE_CHUNK_END(offset, len) \
+    TraceLoggingWrite(g_probe_provider, "ChunkEnd", TraceLoggingInt64(offset, "offset"), TraceLoggingInt32(len, "length"))
+#define PROBE_RING_FULL(pending) \
+    TraceLoggingWrite(g_probe_provider, "RingFull", TraceLoggingInt32(pending, "pending"))
+#define PROBE_DRAIN_COMPLETE(bytes, elapsed_us) \
+    TraceLoggingWrite(g_probe_provider, "DrainComplete", TraceLoggingInt64(bytes, "bytes"), TraceLoggingInt64(elapsed_us, "elapsed_us"))
+#define PROBE_CFOTA_PROGRESS(percent) \
+    TraceLoggingWrite(g_probe_provider, "CfotaProgress", TraceLoggingInt32(percent, "percent"))
+#elif defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_REGISTER() ((void)0)
+#define PROBES_UNREGISTER() ((void)0)
+#define PROBE_COMMAND_SENT(cmd) DTRACE_PROBE1(simcom, command_sent, cmd)
+#define PROBE_LINE_RECEIVED(line, len) DTRACE_PROBE2(simcom, line_received, line, len)
+#define PROBE_CHUNK_START(offset, len) DTRACE_PROBE2(simcom, chunk_start, offset, len)
+#define PROBE_CHUNK_END(offset, len) DTRACE_PROBE2(simcom, chunk_end, offset, len)
+#define PROBE_RING_FULL(pending) DTRACE_PROBE1(simcom, ring_full, pending)
+#define PROBE_DRAIN_COMPLETE(bytes, elapsed_us) DTRACE_PROBE2(simcom, drain_complete, bytes, elapsed_us)
+#define PROBE_CFOTA_PROGRESS(percent) DTRACE_PROBE1(simcom, cfota_progress, percent)
+#endif
+#endif
+
+#ifndef PROBES_REGISTER
+#define PROBES_REGISTER() ((void)0)
+#define PROBES_UNREGISTER() ((void)0)
+#define PROBE_COMMAND_SENT(cmd) ((void)0)
+#define PROBE_LINE_RECEIVED(line, len) ((void)0)
+#define PROBE_CHUNK_START(offset, len) ((void)0)
+#define PROBE_CHUNK_END(offset, len) ((void)0)
+#define PROBE_RING_FULL(pending) ((void)0)
+#define PROBE_DRAIN_COMPLETE(bytes, elapsed_us) ((void)0)
+#define PROBE_CFOTA_PROGRESS(percent) ((void)0)
+#endif
 
 
 typedef struct {
@@ -16,14 +140,58 @@ typedef struct {
     int tail;
     int count;
     CRITICAL_SECTION lock;
+    HANDLE dataEvent;   // auto-reset, signalled whenever bytes are added
 } RingBuffer;
 
+struct DeviceMetrics;
+
+// Per-session memory: one heap allocation at session start, carved into
+// fixed-size payload blocks handed out from a free list, so a running
+// transfer never calls the heap allocator.
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
 typedef struct {
-    HANDLE hCom;
+    char* base;
+    size_t size;
+    int block_size;
+    PoolBlock* free_blocks;
+} SessionArena;
+
+// Link settings for one device. g_profile is the active one: the defaults,
+// or the profile stored by `tune` for the port in use. Each device thread
+// has its own; a session hands a copy to its receive thread.
+typedef struct {
+    char key[64];       // port name ("SIM" for the simulator)
+    char imei[32];      // module identity when tuned (AT+CGSN)
+    int baud;
+    int rtscts;         // hardware flow control (AT+IFC=2,2)
+    int read_size;      // AT+HTTPREAD chunk size
+    int upload_block;   // LFOTA write size
+    int low_latency;    // return-immediately reads and a 1 ms FTDI latency timer
+    int pace_bps;       // loss-free LFOTA upload pace without CTS, bytes/s (0 = unpaced)
+    int pace_gap_ms;    // extra idle time after each paced block
+    double kbps;        // throughput measured at these settings
+} DeviceProfile;
+
+static __declspec(thread) DeviceProfile g_profile = { "", "", 115200, 0, HTTPREAD_DEFAULT_SIZE, ARENA_BLOCK_SIZE, 0, 0, 0, 0.0 };
+static const char* g_profile_path = "simcom_profiles.txt";
+
+typedef struct {
+    HANDLE volatile hCom;
     RingBuffer* rxBuffer;
     volatile int running;
+    struct DeviceMetrics* metrics;
+    SessionArena arena;
+    char port_name[128];        // current name; re-enumeration may change it
+    int baud;
+    volatile LONG reconnects;   // times the port vanished and was reopened
+    DeviceProfile profile;      // the opening thread's link settings
+    char imei[32];              // the module's, once known; a renumbered port must match it
 } SerialPort;
 
+
 // Ring buffer functions
 void ring_buffer_init(RingBuffer* rb) {
     memset(rb->buffer, 0, RING_BUFFER_SIZE);
@@ -31,6 +199,13 @@ void ring_buffer_init(RingBuffer* rb) {
     rb->tail = 0;
     rb->count = 0;
     InitializeCriticalSection(&rb->lock);
+    rb->dataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+void ring_buffer_destroy(RingBuffer* rb) {
+    DeleteCriticalSection(&rb->lock);
+    if (rb->dataEvent) CloseHandle(rb->dataEvent);
+    rb->dataEvent = NULL;
 }
 
 int ring_buffer_put(RingBuffer* rb, char data) {
@@ -46,6 +221,7 @@ int ring_buffer_put(RingBuffer* rb, char data) {
     rb->count++;
 
     LeaveCriticalSection(&rb->lock);
+    SetEvent(rb->dataEvent);
     return 1;
 }
 
@@ -67,6 +243,7 @@ int ring_buffer_put_bulk(RingBuffer* rb, const char* src, int len) {
         rb->head = (rb->head + toWrite) % RING_BUFFER_SIZE;
         rb->count += toWrite;
         LeaveCriticalSection(&rb->lock);
+        SetEvent(rb->dataEvent);
         return toWrite;
     }
     int first = RING_BUFFER_SIZE - rb->head;
@@ -76,6 +253,7 @@ int ring_buffer_put_bulk(RingBuffer* rb, const char* src, int len) {
     rb->head = (rb->head + toWrite) % RING_BUFFER_SIZE;
     rb->count += toWrite;
     LeaveCriticalSection(&rb->lock);
+    SetEvent(rb->dataEvent);
     return toWrite;
 }
 
@@ -184,419 +362,5383 @@ int ring_buffer_read_bulk(RingBuffer* rb, char* dest, int length) {
     return toRead;
 }
 
-// Try to cancel an overlapped I/O operation. Prefer CancelIoEx when available,
-// fall back to CancelIo which cancels all pending I/O for the thread.
-int try_cancel_overlapped(HANDLE hCom, LPOVERLAPPED pov) {
-    typedef BOOL(WINAPI* PCANCELIOEX)(HANDLE, LPOVERLAPPED);
-    HMODULE h = GetModuleHandleA("kernel32.dll");
-    if (h) {
-        PCANCELIOEX p = (PCANCELIOEX)GetProcAddress(h, "CancelIoEx");
-        if (p) {
-            if (p(hCom, pov)) return 1;
-            return 0;
-        }
-    }
-    // Fallback
-    CancelIo(hCom);
-    return 1;
-}
-
-// Wait for either a specific pattern anywhere in the receive buffer OR a full
-// line (ending with '\n'). If 'pattern' is found this returns 1 and places
-// the consumed bytes (up to pattern end) into 'out' (null-terminated). If a
-// full line is available but the pattern wasn't found, it consumes that line
-// and returns 2 and places the line into 'out'. Returns 0 on timeout.
-int wait_for_pattern_or_line(RingBuffer* rb, const char* pattern, char* out, int out_size, int timeout_ms) {
-    DWORD start = GetTickCount();
-    int pat_len = (int)strlen(pattern);
-    if (out_size <= 0) return 0;
-
-    while ((GetTickCount() - start) < (DWORD)timeout_ms) {
-        int avail = ring_buffer_available(rb);
-        if (avail > 0) {
-            int toCopy = avail > RING_BUFFER_SIZE ? RING_BUFFER_SIZE : avail;
-            // copy into temp buffer using peek
-            char tmp[RING_BUFFER_SIZE + 1];
-            int i;
-            for (i = 0; i < toCopy; ++i) {
-                ring_buffer_peek(rb, i, &tmp[i]);
-            }
-            tmp[toCopy] = '\0';
+// Console verbosity. Errors are always printed; everything else goes through
+// log_printf with the level it belongs to.
+enum {
+    LOG_QUIET,      // errors only
+    LOG_PROGRESS,   // step headers, progress and summaries
+    LOG_PROTOCOL,   // every response line
+    LOG_HEXDUMP     // plus hex dumps of payload chunks
+};
 
-            // search for pattern
-            char* p = strstr(tmp, pattern);
-            if (p) {
-                int pos = (int)(p - tmp);
-                int consume = pos + pat_len;
-                int toRead = consume < (out_size - 1) ? consume : (out_size - 1);
-                int n = ring_buffer_read_bulk(rb, out, toRead);
-                out[n] = '\0';
-                return 1; // pattern found
-            }
+static int g_log_level = LOG_PROTOCOL;
+static int g_hexdump_bytes = 64;    // bytes shown from each end of a chunk (0 = all)
+static int g_status_line_open = 0;  // a progress status line is on screen without '\n'
 
-            // if there's a newline, return that line
-            char* nl = strchr(tmp, '\n');
-            if (nl) {
-                int pos = (int)(nl - tmp) + 1;
-                int toRead = pos < (out_size - 1) ? pos : (out_size - 1);
-                int n = ring_buffer_read_bulk(rb, out, toRead);
-                out[n] = '\0';
-                return 2; // returned a line (no pattern)
-            }
-        }
-        Sleep(10);
+void log_printf(int level, const char* fmt, ...) {
+    va_list ap;
+    if (g_log_level < level) return;
+    if (g_status_line_open) {
+        putchar('\n');
+        g_status_line_open = 0;
     }
-    return 0; // timeout
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
 }
 
-// Serial receive thread (uses OVERLAPPED asynchronous reads to reduce blocking)
-DWORD WINAPI serial_receive_thread(LPVOID param) {
-    SerialPort* serial = (SerialPort*)param;
-    DWORD bytesRead = 0;
-    char readBuffer[256];
-    OVERLAPPED ov = { 0 };
-    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+// Parse a --log-level value. Returns -1 if unknown.
+int log_level_from_name(const char* name) {
+    static const char* const names[] = { "quiet", "progress", "protocol", "hexdump" };
+    for (int i = 0; i < 4; ++i) {
+        if (_stricmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
 
-    while (serial->running) {
-        ResetEvent(ov.hEvent);
-        BOOL ok = ReadFile(serial->hCom, readBuffer, sizeof(readBuffer), &bytesRead, &ov);
-        if (!ok) {
-            DWORD err = GetLastError();
-            if (err == ERROR_IO_PENDING) {
-                DWORD wait = WaitForSingleObject(ov.hEvent, 500);
-                if (wait == WAIT_OBJECT_0) {
-                    GetOverlappedResult(serial->hCom, &ov, &bytesRead, FALSE);
-                }
-                else {
-                    // timeout or other
-                    bytesRead = 0;
-                }
-            }
-            else {
-                // immediate error
-                Sleep(1);
-                bytesRead = 0;
-            }
-        }
+static const char hex_digits[] = "0123456789ABCDEF";
 
-        if (bytesRead > 0) {
-            int remaining = (int)bytesRead;
-            char* ptr = readBuffer;
-            while (remaining > 0) {
-                int w = ring_buffer_put_bulk(serial->rxBuffer, ptr, remaining);
-                if (w <= 0) {
-                    // buffer full, wait for consumer
-                    Sleep(1);
-                    continue;
-                }
-                ptr += w;
-                remaining -= w;
-            }
+// Append 16-byte rows for data[from..to) to 'out', offsets relative to 'base'.
+// Returns the new length. 'out' must have room for 60 bytes per row.
+static int hexdump_rows(char* out, int len, const unsigned char* data, int from, int to, long long base) {
+    for (int row = from; row < to; row += 16) {
+        unsigned long long off = (unsigned long long)(base + row);
+        out[len++] = '\n';
+        for (int shift = 28; shift >= 0; shift -= 4) out[len++] = hex_digits[(off >> shift) & 0xF];
+        out[len++] = ':';
+        out[len++] = ' ';
+        int end = row + 16 < to ? row + 16 : to;
+        for (int i = row; i < end; ++i) {
+            out[len++] = hex_digits[data[i] >> 4];
+            out[len++] = hex_digits[data[i] & 0xF];
+            out[len++] = ' ';
         }
     }
-
-    CloseHandle(ov.hEvent);
-    return 0;
+    return len;
 }
 
-// Serial port functions
-HANDLE open_serial_port(const char* portName, int baudRate) {
-    HANDLE hCom;
-    char fullPortName[20];
-    DCB dcb;
-    COMMTIMEOUTS timeouts;
-
-    sprintf_s(fullPortName, sizeof(fullPortName), "\\\\.\\%s", portName);
+// Hex dump of one payload chunk: the first and last g_hexdump_bytes (rounded
+// to whole rows), rendered into one buffer and written with a single fwrite.
+void hexdump_chunk(const unsigned char* data, int len, long long base) {
+    static __declspec(thread) char out[64 * 1024];
+    const int limit = ((int)(sizeof(out) - 128) / 60 / 2 - 1) * 16; // bytes per half that fit in 'out'
+    int head = len, tail_from = len;
+    int used = 0;
 
-    // Open overlapped so we can do async I/O
-    hCom = CreateFileA(fullPortName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
-        OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (g_hexdump_bytes > 0 && len > 2 * g_hexdump_bytes) {
+        head = (g_hexdump_bytes + 15) & ~15;
+        tail_from = (len - g_hexdump_bytes) & ~15;
+    }
+    if (head > limit) head = limit;
+    if (len - tail_from > limit) tail_from = len - limit;
+    if (tail_from < head) tail_from = head;
 
-    if (hCom == INVALID_HANDLE_VALUE) {
-        return INVALID_HANDLE_VALUE;
+    used = hexdump_rows(out, used, data, 0, head, base);
+    if (tail_from > head) {
+        used += snprintf(out + used, sizeof(out) - used, "\n   ... %d bytes ...", tail_from - head);
+        used = hexdump_rows(out, used, data, tail_from, len, base);
     }
+    out[used++] = '\n';
+    fwrite(out, 1, used, stdout);
+}
 
-    // Configure serial port parameters
-    memset(&dcb, 0, sizeof(dcb));
-    dcb.DCBlength = sizeof(dcb);
-    if (!GetCommState(hCom, &dcb)) {
-        CloseHandle(hCom);
-        return INVALID_HANDLE_VALUE;
+// Monotonic clock in microseconds (QueryPerformanceCounter based).
+LONGLONG mono_now_us(void) {
+    static LONGLONG freq = 0;
+    LARGE_INTEGER now;
+    if (freq == 0) {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        freq = f.QuadPart;
     }
+    QueryPerformanceCounter(&now);
+    return (LONGLONG)((double)now.QuadPart * 1000000.0 / (double)freq);
+}
 
-    dcb.BaudRate = baudRate;
-    dcb.ByteSize = 8;
-    dcb.Parity = NOPARITY;
-    dcb.StopBits = ONESTOPBIT;
-    dcb.fDtrControl = DTR_CONTROL_ENABLE;
-    dcb.fRtsControl = RTS_CONTROL_ENABLE;
+ULONGLONG mono_now_ms(void) {
+    return (ULONGLONG)(mono_now_us() / 1000);
+}
 
-    if (!SetCommState(hCom, &dcb)) {
-        CloseHandle(hCom);
-        return INVALID_HANDLE_VALUE;
-    }
+// Hierarchical timer wheel (4 levels x 64 slots, 1 ms ticks, ~4.6 h range).
+// Timers are intrusive list nodes, so add and cancel are O(1); advancing
+// costs O(1) per elapsed tick plus an occasional cascade of one slot. Each
+// thread owns a wheel that holds every deadline it is waiting on (command
+// responses, write/drain, CFOTA); the HTTPREAD engine keeps its stall
+// check on its Clock policy so simulated runs expire in virtual time.
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer* prev;
+    ULONGLONG expires;      // wheel tick (ms) at which the timer fires
+    int fired;
+} Timer;
 
-    // Configure timeouts
-    memset(&timeouts, 0, sizeof(timeouts));
-    timeouts.ReadIntervalTimeout = 50;
-    timeouts.ReadTotalTimeoutConstant = 50;
-    timeouts.ReadTotalTimeoutMultiplier = 10;
-    timeouts.WriteTotalTimeoutConstant = 10;
-    timeouts.WriteTotalTimeoutMultiplier = 10;
+typedef struct {
+    Timer slots[TW_LEVELS][TW_SLOTS];   // list heads
+    ULONGLONG now;
+    int pending;
+} TimerWheel;
 
-    if (!SetCommTimeouts(hCom, &timeouts)) {
-        CloseHandle(hCom);
-        return INVALID_HANDLE_VALUE;
-    }
+static __declspec(thread) TimerWheel* t_wheel;
 
-    return hCom;
+static void tw_link(Timer* head, Timer* t) {
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
 }
 
-int send_at_command(HANDLE hCom, const char* command) {
-    DWORD bytesWritten = 0;
-    char fullCommand[256];
-    sprintf_s(fullCommand, sizeof(fullCommand), "%s\r\n", command);
+static void tw_unlink(Timer* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
 
-    // Use OVERLAPPED WriteFile to avoid blocking the caller. We open the port with
-    // FILE_FLAG_OVERLAPPED, so this will be asynchronous when needed.
-    OVERLAPPED ov = { 0 };
-    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    DWORD len = (DWORD)strlen(fullCommand);
+static void tw_place(TimerWheel* w, Timer* t) {
+    const ULONGLONG range = (ULONGLONG)1 << (TW_BITS * TW_LEVELS);
+    ULONGLONG when = t->expires > w->now ? t->expires : w->now;
+    if (when - w->now >= range) when = w->now + range - 1; // re-placed on cascade
+    int level = 0;
+    while (level < TW_LEVELS - 1 && when - w->now >= ((ULONGLONG)1 << (TW_BITS * (level + 1)))) level++;
+    tw_link(&w->slots[level][(when >> (TW_BITS * level)) & (TW_SLOTS - 1)], t);
+}
 
-    BOOL ok = WriteFile(hCom, fullCommand, len, &bytesWritten, &ov);
-    if (!ok) {
-        DWORD err = GetLastError();
-        if (err == ERROR_IO_PENDING) {
-            // wait for completion with a modest timeout
-            DWORD wait = WaitForSingleObject(ov.hEvent, 2000);
-            if (wait == WAIT_OBJECT_0) {
-                if (!GetOverlappedResult(hCom, &ov, &bytesWritten, FALSE)) {
-                    CloseHandle(ov.hEvent);
-                    return 0;
-                }
-            }
-            else {
-                // timeout or error; cancel pending I/O
-                CancelIo(hCom);
-                CloseHandle(ov.hEvent);
-                return 0;
+void timer_wheel_init(TimerWheel* w, ULONGLONG now) {
+    for (int l = 0; l < TW_LEVELS; ++l) {
+        for (int s = 0; s < TW_SLOTS; ++s) {
+            w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+        }
+    }
+    w->now = now;
+    w->pending = 0;
+}
+
+// Run the wheel forward to 'now', firing every timer that expired.
+void timer_wheel_advance(TimerWheel* w, ULONGLONG now) {
+    if (w->pending == 0) {
+        if (now > w->now) w->now = now;
+        return;
+    }
+    while (w->now < now) {
+        w->now++;
+        // Cascade from the highest level whose lower digits just wrapped
+        int top = 0;
+        while (top + 1 < TW_LEVELS && (w->now & (((ULONGLONG)1 << (TW_BITS * (top + 1))) - 1)) == 0) top++;
+        for (int level = top; level >= 1; --level) {
+            Timer* head = &w->slots[level][(w->now >> (TW_BITS * level)) & (TW_SLOTS - 1)];
+            while (head->next != head) {
+                Timer* t = head->next;
+                tw_unlink(t);
+                tw_place(w, t);
             }
         }
-        else {
-            CloseHandle(ov.hEvent);
-            return 0;
+        Timer* head = &w->slots[0][w->now & (TW_SLOTS - 1)];
+        while (head->next != head) {
+            Timer* t = head->next;
+            tw_unlink(t);
+            t->fired = 1;
+            w->pending--;
+        }
+        if (w->pending == 0) {
+            w->now = now;
+            break;
         }
     }
+}
 
-    CloseHandle(ov.hEvent);
-    return (bytesWritten == len);
+void timer_add(TimerWheel* w, Timer* t, DWORD timeout_ms) {
+    timer_wheel_advance(w, mono_now_ms());
+    t->fired = 0;
+    t->expires = w->now + timeout_ms;
+    w->pending++;
+    tw_place(w, t);
 }
 
-// Read a line from the ring buffer
-int read_line_from_buffer(RingBuffer* rb, char* buffer, int bufferSize) {
-    // Find newline without removing bytes first
-    int idx = ring_buffer_find_char(rb, '\n');
-    if (idx == -1) return 0; // no complete line yet
+void timer_cancel(TimerWheel* w, Timer* t) {
+    if (t->next) {
+        tw_unlink(t);
+        w->pending--;
+    }
+}
 
-    int toCopy = idx + 1; // include the '\n'
-    if (toCopy > bufferSize - 1) toCopy = bufferSize - 1; // avoid overflow
+static TimerWheel* thread_wheel(void) {
+    if (!t_wheel) {
+        t_wheel = (TimerWheel*)malloc(sizeof(TimerWheel));
+        if (t_wheel) timer_wheel_init(t_wheel, mono_now_ms());
+    }
+    return t_wheel;
+}
 
-    int n = ring_buffer_read_bulk(rb, buffer, toCopy);
-    if (n <= 0) return 0;
-    buffer[n] = '\0';
-    return 1;
+// Deadlines on the calling thread's wheel. A started deadline must be
+// finished with deadline_cancel (which is a no-op once it has fired).
+void deadline_start(Timer* t, DWORD timeout_ms) {
+    t->next = t->prev = NULL;
+    TimerWheel* w = thread_wheel();
+    if (w) {
+        timer_add(w, t, timeout_ms);
+    }
+    else {
+        t->fired = 0;
+        t->expires = mono_now_ms() + timeout_ms;
+    }
 }
 
+int deadline_expired(Timer* t) {
+    ULONGLONG now = mono_now_ms();
+    if (t->fired) return 1;
+    if (t_wheel && t->next) timer_wheel_advance(t_wheel, now);
+    else if (now >= t->expires) t->fired = 1;
+    return t->fired;
+}
 
-// Wait for a specific response
-int wait_for_response(RingBuffer* rb, const char* expected, int timeout_ms) {
-    char line[256];
-    DWORD startTime = GetTickCount();
+DWORD deadline_remaining_ms(const Timer* t) {
+    ULONGLONG now = mono_now_ms();
+    return t->fired || now >= t->expires ? 0 : (DWORD)(t->expires - now);
+}
 
-    while ((GetTickCount() - startTime) < (DWORD)timeout_ms) {
-        if (read_line_from_buffer(rb, line, sizeof(line))) {
-            printf("Received: %s", line);
+void deadline_cancel(Timer* t) {
+    if (t_wheel) timer_cancel(t_wheel, t);
+}
 
-            if (strstr(line, expected) != NULL) {
-                return 1;
-            }
+void deadline_restart(Timer* t, DWORD timeout_ms) {
+    deadline_cancel(t);
+    deadline_start(t, timeout_ms);
+}
+
+// Write 's' as a JSON string literal (with quotes and escapes).
+void json_write_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
         }
-        Sleep(1);
+        else if (c == '\r') fputs("\\r", f);
+        else if (c == '\n') fputs("\\n", f);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
     }
-    return 0;
+    fputc('"', f);
 }
 
-// Parse numeric response
-int parse_number_response(RingBuffer* rb, const char* prefix, int* value, int timeout_ms) {
-    char line[256];
-    DWORD startTime = GetTickCount();
+// Chrome trace (Perfetto-compatible) event recorder. Events are collected in
+// memory while enabled and written as JSON at exit with trace_write.
+typedef struct {
+    char name[64];
+    const char* cat;
+    char ph;            // 'X' complete span, 'i' instant, 'M' thread name
+    DWORD tid;
+    LONGLONG ts_us;
+    LONGLONG dur_us;
+    long long bytes;    // -1 if not applicable
+    char result[24];
+} TraceEvent;
 
-    while ((GetTickCount() - startTime) < (DWORD)timeout_ms) {
-        if (read_line_from_buffer(rb, line, sizeof(line))) {
-            printf("Received: %s", line);
+typedef struct {
+    TraceEvent* events;
+    int count;
+    int capacity;
+    int dropped;
+    volatile int enabled;
+    LONGLONG origin_us;
+    CRITICAL_SECTION lock;
+} TraceLog;
 
-            const char* pos = strstr(line, prefix);
-            if (pos != NULL) {
-                pos += strlen(prefix);
-                while (*pos && !isdigit(*pos)) pos++;
-                if (*pos) {
-                    *value = atoi(pos);
-                    return 1;
-                }
-            }
+static TraceLog g_trace;
+
+void trace_init(void) {
+    memset(&g_trace, 0, sizeof(g_trace));
+    InitializeCriticalSection(&g_trace.lock);
+    g_trace.origin_us = mono_now_us();
+    g_trace.enabled = 1;
+}
+
+static void trace_record(char ph, const char* cat, const char* name, LONGLONG ts_us, LONGLONG dur_us,
+    long long bytes, const char* result) {
+    EnterCriticalSection(&g_trace.lock);
+    if (g_trace.count >= g_trace.capacity) {
+        int cap = g_trace.capacity ? g_trace.capacity * 2 : 4096;
+        TraceEvent* grown = NULL;
+        if (cap <= TRACE_MAX_EVENTS) grown = (TraceEvent*)realloc(g_trace.events, sizeof(TraceEvent) * cap);
+        if (!grown) {
+            g_trace.dropped++;
+            LeaveCriticalSection(&g_trace.lock);
+            return;
         }
-        Sleep(1);
+        g_trace.events = grown;
+        g_trace.capacity = cap;
     }
-    return 0;
+    TraceEvent* ev = &g_trace.events[g_trace.count++];
+    snprintf(ev->name, sizeof(ev->name), "%s", name);
+    ev->cat = cat;
+    ev->ph = ph;
+    ev->tid = GetCurrentThreadId();
+    ev->ts_us = ts_us - g_trace.origin_us;
+    ev->dur_us = dur_us;
+    ev->bytes = bytes;
+    snprintf(ev->result, sizeof(ev->result), "%s", result ? result : "");
+    LeaveCriticalSection(&g_trace.lock);
 }
 
-// Enumerate available serial ports
-void enumerate_serial_ports() {
-    printf("Available serial ports:\n");
+// Record a span that started at 'start_us' (from mono_now_us) and ends now.
+void trace_span(const char* cat, const char* name, LONGLONG start_us, long long bytes, const char* result) {
+    if (!g_trace.enabled) return;
+    trace_record('X', cat, name, start_us, mono_now_us() - start_us, bytes, result);
+}
 
-    for (int i = 1; i <= 20; i++) {
-        char portName[20];
-        HANDLE hCom;
+void trace_instant(const char* cat, const char* name, long long value) {
+    if (!g_trace.enabled) return;
+    trace_record('i', cat, name, mono_now_us(), 0, value, NULL);
+}
 
-        sprintf_s(portName, sizeof(portName), "COM%d", i);
-        hCom = CreateFileA(portName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
-            OPEN_EXISTING, 0, NULL);
+// Label the calling thread in the trace viewer.
+void trace_thread_name(const char* name) {
+    if (!g_trace.enabled) return;
+    trace_record('M', "__metadata", name, g_trace.origin_us, 0, -1, NULL);
+}
 
-        if (hCom != INVALID_HANDLE_VALUE) {
-            printf("  %s\n", portName);
-            CloseHandle(hCom);
+// Write all recorded events as Chrome trace JSON. Returns 1 on success.
+int trace_write(const char* path) {
+    FILE* f;
+    if (!g_trace.enabled) return 0;
+    if (fopen_s(&f, path, "wb") != 0) {
+        printf("Unable to create trace file %s\n", path);
+        return 0;
+    }
+    EnterCriticalSection(&g_trace.lock);
+    DWORD pid = GetCurrentProcessId();
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < g_trace.count; ++i) {
+        const TraceEvent* ev = &g_trace.events[i];
+        if (ev->ph == 'M') {
+            fprintf(f, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%lu,\"tid\":%lu,\"args\":{\"name\":",
+                (unsigned long)pid, (unsigned long)ev->tid);
+            json_write_string(f, ev->name);
+            fprintf(f, "}}");
+        }
+        else {
+            fprintf(f, "{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":", ev->ph, ev->cat);
+            json_write_string(f, ev->name);
+            fprintf(f, ",\"pid\":%lu,\"tid\":%lu,\"ts\":%lld", (unsigned long)pid, (unsigned long)ev->tid, (long long)ev->ts_us);
+            if (ev->ph == 'X') fprintf(f, ",\"dur\":%lld", (long long)ev->dur_us);
+            else fprintf(f, ",\"s\":\"t\"");
+            fprintf(f, ",\"args\":{");
+            int comma = 0;
+            if (ev->bytes >= 0) {
+                fprintf(f, "\"bytes\":%lld", ev->bytes);
+                comma = 1;
+            }
+            if (ev->result[0]) {
+                fprintf(f, "%s\"result\":", comma ? "," : "");
+                json_write_string(f, ev->result);
+            }
+            fprintf(f, "}}");
         }
+        fprintf(f, i + 1 < g_trace.count ? ",\n" : "\n");
     }
+    fprintf(f, "]}\n");
+    int count = g_trace.count, dropped = g_trace.dropped;
+    LeaveCriticalSection(&g_trace.lock);
+    fclose(f);
+    printf("Trace written to %s (%d events", path, count);
+    if (dropped) printf(", %d dropped", dropped);
+    printf(")\n");
+    return 1;
 }
 
-// Download file data
-int download_file_data(HANDLE hCom, RingBuffer* rb, const char* filename, int total_size) {
-    FILE* file;
-    int offset = 0;
-    int packet_size = 4096;
-    char command[256];
-    char line[256];
-    int bytes_received = 0;
+// Machine-readable run report (--report). AT steps are recorded from the
+// same hooks that close trace spans; main fills in the rest.
+typedef struct {
+    char command[96];
+    double at_s;            // seconds since run start
+    double latency_ms;
+    char result[32];
+} ReportStep;
 
-    if (fopen_s(&file, filename, "wb") != 0) {
-        printf("Unable to create file %s\n", filename);
-        return 0;
-    }
+typedef struct {
+    double at_s;
+    int progress;           // -1 for non-progress events
+    char event[16];
+} ReportCfotaEvent;
 
-    while (offset < total_size) {
-        int current_size = (total_size - offset) > packet_size ? packet_size : (total_size - offset);
-        int retries = 0;
+typedef struct {
+    LONGLONG start_us;
+    ReportStep steps[REPORT_MAX_STEPS];
+    int step_count;
+    int http_status;
+    long long content_length;
+    long long download_bytes;
+    double download_s;
+    long long upload_bytes;
+    double upload_s;
+    long long retries;
+    long long line_errors;
+    long long overruns;
+    ReportCfotaEvent cfota[REPORT_MAX_CFOTA_EVENTS];
+    int cfota_count;
+    char fw_before[96];
+    char fw_after[96];
+    const char* phase;      // last phase entered
+    int success;
+} RunReport;
+
+static __declspec(thread) RunReport* t_report;
+
+void report_begin(RunReport* r) {
+    memset(r, 0, sizeof(*r));
+    r->start_us = mono_now_us();
+    r->http_status = -1;
+    r->content_length = -1;
+    r->phase = "startup";
+    t_report = r;
+}
+
+static void report_step(const char* command, LONGLONG sent_us, const char* result) {
+    RunReport* r = t_report;
+    // HTTPREAD runs once per chunk; its cost shows up in the download figures
+    if (!r || r->step_count >= REPORT_MAX_STEPS || strncmp(command, "AT+HTTPREAD", 11) == 0) return;
+    ReportStep* st = &r->steps[r->step_count++];
+    snprintf(st->command, sizeof(st->command), "%s", command);
+    st->at_s = (double)(sent_us - r->start_us) / 1000000.0;
+    st->latency_ms = (double)(mono_now_us() - sent_us) / 1000.0;
+    snprintf(st->result, sizeof(st->result), "%s", result);
+}
+
+void report_cfota_event(RunReport* r, const char* event, int progress) {
+    if (!r || r->cfota_count >= REPORT_MAX_CFOTA_EVENTS) return;
+    ReportCfotaEvent* ev = &r->cfota[r->cfota_count++];
+    ev->at_s = (double)(mono_now_us() - r->start_us) / 1000000.0;
+    ev->progress = progress;
+    snprintf(ev->event, sizeof(ev->event), "%s", event);
+}
+
+// Copy the version out of a "+CGMR: <version>" line.
+void report_firmware(char* dst, int dst_size, const char* line) {
+    const char* p = strstr(line, "+CGMR:");
+    if (!p) return;
+    p += 6;
+    while (*p == ' ') p++;
+    snprintf(dst, dst_size, "%s", p);
+    dst[strcspn(dst, "\r\n")] = '\0';
+}
+
+int report_write(const RunReport* r, const char* path) {
+    FILE* f;
+    if (fopen_s(&f, path, "w") != 0) {
+        printf("Unable to create report file %s\n", path);
+        return 0;
+    }
+    fprintf(f, "{\n  \"outcome\": \"%s\",\n  \"phase\": \"%s\",\n", r->success ? "success" : "failed", r->phase);
+    fprintf(f, "  \"duration_s\": %.3f,\n", (double)(mono_now_us() - r->start_us) / 1000000.0);
+    fprintf(f, "  \"http_status\": %d,\n  \"content_length\": %lld,\n", r->http_status, r->content_length);
+    fprintf(f, "  \"download\": {\"bytes\": %lld, \"seconds\": %.3f, \"bytes_per_s\": %.1f},\n", r->download_bytes,
+        r->download_s, r->download_s > 0.0 ? (double)r->download_bytes / r->download_s : 0.0);
+    fprintf(f, "  \"upload\": {\"bytes\": %lld, \"seconds\": %.3f, \"bytes_per_s\": %.1f},\n", r->upload_bytes,
+        r->upload_s, r->upload_s > 0.0 ? (double)r->upload_bytes / r->upload_s : 0.0);
+    fprintf(f, "  \"retries\": %lld,\n  \"line_errors\": %lld,\n  \"overruns\": %lld,\n", r->retries, r->line_errors,
+        r->overruns);
+    fprintf(f, "  \"firmware_before\": ");
+    json_write_string(f, r->fw_before);
+    fprintf(f, ",\n  \"firmware_after\": ");
+    json_write_string(f, r->fw_after);
+    fprintf(f, ",\n  \"steps\": [");
+    for (int i = 0; i < r->step_count; ++i) {
+        const ReportStep* st = &r->steps[i];
+        fprintf(f, "%s\n    {\"command\": ", i ? "," : "");
+        json_write_string(f, st->command);
+        fprintf(f, ", \"at_s\": %.3f, \"latency_ms\": %.1f, \"result\": ", st->at_s, st->latency_ms);
+        json_write_string(f, st->result);
+        fprintf(f, "}");
+    }
+    fprintf(f, "%s],\n  \"cfota\": [", r->step_count ? "\n  " : "");
+    for (int i = 0; i < r->cfota_count; ++i) {
+        const ReportCfotaEvent* ev = &r->cfota[i];
+        fprintf(f, "%s\n    {\"at_s\": %.3f, \"event\": \"%s\"", i ? "," : "", ev->at_s, ev->event);
+        if (ev->progress >= 0) fprintf(f, ", \"progress\": %d", ev->progress);
+        fprintf(f, "}");
+    }
+    fprintf(f, "%s]\n}\n", r->cfota_count ? "\n  " : "");
+    fclose(f);
+    log_printf(LOG_PROGRESS, "Run report written to %s\n", path);
+    return 1;
+}
+
+// Per-thread state of the AT command currently in flight, so its span can
+// be closed (send -> first response byte -> terminal result) by whichever
+// helper consumes the response.
+typedef struct {
+    char command[96];
+    LONGLONG sent_us;
+    LONGLONG first_us;
+    int active;
+} AtSpan;
+
+static __declspec(thread) AtSpan t_at_span;
+
+void at_span_begin(const char* command) {
+    if (!g_trace.enabled && !t_report) return;
+    snprintf(t_at_span.command, sizeof(t_at_span.command), "%s", command);
+    t_at_span.sent_us = mono_now_us();
+    t_at_span.first_us = 0;
+    t_at_span.active = 1;
+}
+
+// Called for every response line consumed; marks the first byte of the reply.
+void at_span_line(void) {
+    if (!t_at_span.active || t_at_span.first_us) return;
+    t_at_span.first_us = mono_now_us();
+    if (g_trace.enabled) trace_record('X', "at", "await first byte", t_at_span.sent_us, t_at_span.first_us - t_at_span.sent_us, -1, NULL);
+}
+
+void at_span_end(const char* result) {
+    if (!t_at_span.active) return;
+    t_at_span.active = 0;
+    trace_span("at", t_at_span.command, t_at_span.sent_us, -1, result);
+    report_step(t_at_span.command, t_at_span.sent_us, result);
+}
+
+// Hot-path counters. Each device owns a set of per-thread slots; a thread
+// attaches to its device once and then only ever touches its own slot, so
+// updates are uncontended interlocked adds. Readers sum the slots.
+enum {
+    MET_RX_BYTES,
+    MET_TX_BYTES,
+    MET_CHUNKS,
+    MET_RETRIES,
+    MET_LINE_ERRORS,
+    MET_RING_STALLS,
+    MET_POLL_SLEEP_US,
+    MET_RING_STALL_US,
+    MET_HEAP_ALLOCS,
+    MET_RECONNECTS,
+    MET_OFFLINE_US,
+    MET_OVERRUNS,
+    MET_COUNT
+};
+
+enum {
+    PHASE_HANDSHAKE,
+    PHASE_HTTP_ACTION,
+    PHASE_DOWNLOAD,
+    PHASE_UPLOAD,
+    PHASE_CFOTA,
+    PHASE_VERIFY,
+    PHASE_COUNT
+};
+
+static const char* const metric_names[MET_COUNT] = {
+    "rx_bytes_total", "tx_bytes_total", "chunks_total", "retries_total",
+    "line_errors_total", "ring_stalls_total", "poll_sleep_microseconds_total",
+    "ring_stall_microseconds_total", "heap_allocs_total", "reconnects_total",
+    "port_offline_microseconds_total", "overruns_total"
+};
+
+static const char* const metric_help[MET_COUNT] = {
+    "Bytes received from the module.",
+    "Bytes written to the module.",
+    "HTTPREAD payload chunks received.",
+    "Protocol retries.",
+    "UART framing, parity and overrun errors reported by the driver.",
+    "Times the receive thread found the ring buffer full.",
+    "Time spent sleeping in polling loops.",
+    "Time the receive thread waited for ring buffer space.",
+    "Heap allocations made by the session (zero in steady state).",
+    "Times the port vanished (module reboot, USB re-enumeration) and was reopened.",
+    "Time the port was away before it was reopened.",
+    "Receive overruns reported by the driver (UART FIFO or input buffer): bytes were lost."
+};
+
+static const char* const phase_names[PHASE_COUNT] = {
+    "handshake", "http_action", "download", "upload", "cfota", "verify"
+};
+
+typedef struct {
+    volatile LONG64 counters[MET_COUNT];
+    char pad[64]; // keep neighbouring slots off the same cache line
+} MetricsSlot;
+
+typedef struct DeviceMetrics {
+    char device[32];
+    MetricsSlot slots[METRICS_MAX_SLOTS];
+    volatile LONG slots_used;
+    volatile LONG64 phase_us[PHASE_COUNT];
+    int users;              // runs holding the entry (under g_metrics_lock)
+} DeviceMetrics;
+
+static DeviceMetrics g_metrics[METRICS_MAX_DEVICES];
+static volatile LONG g_metrics_count = 0;
+static SRWLOCK g_metrics_lock = SRWLOCK_INIT;
+static __declspec(thread) MetricsSlot* t_metrics_slot;
+static __declspec(thread) DeviceMetrics* t_metrics_device;
+
+// Register a device (e.g. its COM port name or IMEI); a name seen before
+// gets its entry back, so its counters keep adding up. With the table full,
+// an entry no run holds any more is cleared and reused. Returns NULL if
+// every entry is held. Release it with metrics_release_device().
+DeviceMetrics* metrics_register_device(const char* name) {
+    DeviceMetrics* dev = NULL;
+    AcquireSRWLockExclusive(&g_metrics_lock);
+    LONG count = g_metrics_count;
+    for (LONG i = 0; i < count && !dev; ++i) {
+        if (strncmp(g_metrics[i].device, name, sizeof(g_metrics[i].device) - 1) == 0) dev = &g_metrics[i];
+    }
+    // A returning device starts handing out thread slots from the first again
+    if (dev && dev->users == 0) dev->slots_used = 0;
+    if (!dev && count < METRICS_MAX_DEVICES) {
+        dev = &g_metrics[count];
+        snprintf(dev->device, sizeof(dev->device), "%s", name);
+        InterlockedExchange(&g_metrics_count, count + 1);   // exporters see it once named
+    }
+    for (LONG i = 0; i < count && !dev; ++i) {
+        if (g_metrics[i].users == 0) {
+            dev = &g_metrics[i];
+            memset(dev, 0, sizeof(*dev));
+            snprintf(dev->device, sizeof(dev->device), "%s", name);
+        }
+    }
+    if (dev) dev->users++;
+    ReleaseSRWLockExclusive(&g_metrics_lock);
+    return dev;
+}
+
+void metrics_release_device(DeviceMetrics* dev) {
+    if (!dev) return;
+    AcquireSRWLockExclusive(&g_metrics_lock);
+    dev->users--;
+    ReleaseSRWLockExclusive(&g_metrics_lock);
+}
+
+// Bind the calling thread to a slot of 'dev'. Threads beyond the slot count
+// share the last slot (still correct, just contended).
+void metrics_attach_thread(DeviceMetrics* dev) {
+    t_metrics_device = dev;
+    if (!dev) {
+        t_metrics_slot = NULL;
+        return;
+    }
+    LONG idx = InterlockedIncrement(&dev->slots_used) - 1;
+    if (idx >= METRICS_MAX_SLOTS) idx = METRICS_MAX_SLOTS - 1;
+    t_metrics_slot = &dev->slots[idx];
+}
+
+void metrics_add(int counter, LONG64 value) {
+    if (t_metrics_slot) InterlockedExchangeAdd64(&t_metrics_slot->counters[counter], value);
+}
+
+LONG64 metrics_get(DeviceMetrics* dev, int counter) {
+    LONG64 sum = 0;
+    for (int i = 0; i < METRICS_MAX_SLOTS; ++i) {
+        sum += InterlockedCompareExchange64(&dev->slots[i].counters[counter], 0, 0);
+    }
+    return sum;
+}
+
+// Add the time elapsed since 'start_us' to a phase of 'dev'.
+void metrics_phase(DeviceMetrics* dev, int phase, LONGLONG start_us) {
+    if (dev) InterlockedExchangeAdd64(&dev->phase_us[phase], mono_now_us() - start_us);
+}
+
+// Device the calling thread is attached to (NULL if none).
+DeviceMetrics* metrics_current_device(void) {
+    return t_metrics_device;
+}
+
+// Heap allocation counted against the calling thread's device.
+void* heap_alloc(size_t size) {
+    metrics_add(MET_HEAP_ALLOCS, 1);
+    return malloc(size);
+}
+
+static __declspec(thread) SessionArena* t_arena;
+
+int arena_init(SessionArena* a, int block_size, int blocks) {
+    memset(a, 0, sizeof(*a));
+    a->size = (size_t)block_size * blocks;
+    a->base = (char*)heap_alloc(a->size);
+    if (!a->base) return 0;
+    a->block_size = block_size;
+    for (int i = blocks - 1; i >= 0; --i) {
+        PoolBlock* b = (PoolBlock*)(a->base + (size_t)i * block_size);
+        b->next = a->free_blocks;
+        a->free_blocks = b;
+    }
+    return 1;
+}
+
+void arena_destroy(SessionArena* a) {
+    free(a->base);
+    memset(a, 0, sizeof(*a));
+}
+
+// Arena of the session running on the calling thread (NULL if none).
+SessionArena* arena_current(void) {
+    return t_arena;
+}
+
+// Take a block of at least 'size' bytes. Falls back to the (counted) heap
+// when there is no session, the pool is empty or 'size' is too large.
+char* arena_block_get(SessionArena* a, int size) {
+    if (a && a->free_blocks && size <= a->block_size) {
+        PoolBlock* b = a->free_blocks;
+        a->free_blocks = b->next;
+        return (char*)b;
+    }
+    return (char*)heap_alloc((size_t)size);
+}
+
+void arena_block_put(SessionArena* a, char* block) {
+    if (!block) return;
+    if (a && block >= a->base && block < a->base + a->size) {
+        PoolBlock* b = (PoolBlock*)block;
+        b->next = a->free_blocks;
+        a->free_blocks = b;
+        return;
+    }
+    free(block);
+}
+
+// Sleep inside a polling loop, accounting the time slept.
+void poll_sleep(DWORD ms) {
+    LONGLONG start = mono_now_us();
+    Sleep(ms);
+    metrics_add(MET_POLL_SLEEP_US, mono_now_us() - start);
+}
+
+// Render all devices in Prometheus text exposition format. Returns length.
+int metrics_format_prometheus(char* out, int out_size) {
+    int len = 0;
+    AcquireSRWLockShared(&g_metrics_lock);     // entries are renamed and cleared when reused
+    LONG count = g_metrics_count;
+    if (count > METRICS_MAX_DEVICES) count = METRICS_MAX_DEVICES;
+    for (int m = 0; m < MET_COUNT && len < out_size; ++m) {
+        len += snprintf(out + len, out_size - len, "# HELP simcom_%s %s\n# TYPE simcom_%s counter\n",
+            metric_names[m], metric_help[m], metric_names[m]);
+        for (LONG d = 0; d < count && len < out_size; ++d) {
+            len += snprintf(out + len, out_size - len, "simcom_%s{device=\"%s\"} %lld\n",
+                metric_names[m], g_metrics[d].device, (long long)metrics_get(&g_metrics[d], m));
+        }
+    }
+    if (len < out_size) {
+        len += snprintf(out + len, out_size - len,
+            "# HELP simcom_phase_seconds Time spent per protocol phase.\n# TYPE simcom_phase_seconds gauge\n");
+    }
+    for (LONG d = 0; d < count && len < out_size; ++d) {
+        for (int p = 0; p < PHASE_COUNT && len < out_size; ++p) {
+            len += snprintf(out + len, out_size - len, "simcom_phase_seconds{device=\"%s\",phase=\"%s\"} %.6f\n",
+                g_metrics[d].device, phase_names[p],
+                (double)InterlockedCompareExchange64(&g_metrics[d].phase_us[p], 0, 0) / 1000000.0);
+        }
+    }
+    ReleaseSRWLockShared(&g_metrics_lock);
+    return len < out_size ? len : out_size - 1;
+}
+
+// Write a JSON snapshot of all devices (atomically replaces 'path').
+int metrics_write_json(const char* path) {
+    char tmp_path[MAX_PATH];
+    FILE* f;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (fopen_s(&f, tmp_path, "wb") != 0) return 0;
+    AcquireSRWLockShared(&g_metrics_lock);
+    LONG count = g_metrics_count;
+    if (count > METRICS_MAX_DEVICES) count = METRICS_MAX_DEVICES;
+    fprintf(f, "{\"devices\":[");
+    for (LONG d = 0; d < count; ++d) {
+        fprintf(f, "%s{\"device\":", d ? "," : "");
+        json_write_string(f, g_metrics[d].device);
+        for (int m = 0; m < MET_COUNT; ++m) {
+            fprintf(f, ",\"%s\":%lld", metric_names[m], (long long)metrics_get(&g_metrics[d], m));
+        }
+        fprintf(f, ",\"phase_seconds\":{");
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            fprintf(f, "%s\"%s\":%.6f", p ? "," : "", phase_names[p],
+                (double)InterlockedCompareExchange64(&g_metrics[d].phase_us[p], 0, 0) / 1000000.0);
+        }
+        fprintf(f, "}}");
+    }
+    ReleaseSRWLockShared(&g_metrics_lock);
+    fprintf(f, "]}\n");
+    fclose(f);
+    return MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) ? 1 : 0;
+}
+
+// Optional exporters: a loopback HTTP endpoint serving Prometheus text and/or
+// a JSON file rewritten periodically.
+typedef struct {
+    SOCKET listener;
+    const char* json_path;
+    volatile int running;
+    HANDLE hHttpThread;
+    HANDLE hJsonThread;
+} MetricsExporter;
+
+static DWORD WINAPI metrics_http_thread(LPVOID param) {
+    MetricsExporter* ex = (MetricsExporter*)param;
+    static char body[32768];
+    char header[128];
+    char request[1024];
+    while (ex->running) {
+        SOCKET c = accept(ex->listener, NULL, NULL);
+        if (c == INVALID_SOCKET) continue;
+        recv(c, request, sizeof(request), 0); // any request gets the metrics page
+        int n = metrics_format_prometheus(body, sizeof(body));
+        int h = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", n);
+        send(c, header, h, 0);
+        send(c, body, n, 0);
+        closesocket(c);
+    }
+    return 0;
+}
+
+static DWORD WINAPI metrics_json_thread(LPVOID param) {
+    MetricsExporter* ex = (MetricsExporter*)param;
+    while (ex->running) {
+        metrics_write_json(ex->json_path);
+        Sleep(METRICS_JSON_INTERVAL_MS);
+    }
+    metrics_write_json(ex->json_path);
+    return 0;
+}
+
+// Start the exporters that were requested (port 0 / NULL path disables each).
+int metrics_exporter_start(MetricsExporter* ex, int port, const char* json_path) {
+    memset(ex, 0, sizeof(*ex));
+    ex->listener = INVALID_SOCKET;
+    ex->json_path = json_path;
+    ex->running = 1;
+
+    if (port > 0) {
+        WSADATA wsa;
+        struct sockaddr_in addr;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return 0;
+        ex->listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (ex->listener == INVALID_SOCKET) return 0;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(ex->listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(ex->listener, 4) != 0) {
+            closesocket(ex->listener);
+            ex->listener = INVALID_SOCKET;
+            return 0;
+        }
+        ex->hHttpThread = CreateThread(NULL, 0, metrics_http_thread, ex, 0, NULL);
+        log_printf(LOG_PROGRESS, "Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+    }
+    if (json_path) {
+        ex->hJsonThread = CreateThread(NULL, 0, metrics_json_thread, ex, 0, NULL);
+        log_printf(LOG_PROGRESS, "Writing metrics snapshots to %s\n", json_path);
+    }
+    return 1;
+}
+
+void metrics_exporter_stop(MetricsExporter* ex) {
+    ex->running = 0;
+    if (ex->listener != INVALID_SOCKET) {
+        closesocket(ex->listener); // unblocks accept()
+        ex->listener = INVALID_SOCKET;
+    }
+    if (ex->hHttpThread) {
+        WaitForSingleObject(ex->hHttpThread, 1000);
+        CloseHandle(ex->hHttpThread);
+        WSACleanup();
+    }
+    if (ex->hJsonThread) {
+        WaitForSingleObject(ex->hJsonThread, METRICS_JSON_INTERVAL_MS * 2);
+        CloseHandle(ex->hJsonThread);
+    }
+}
+
+// Parse a decimal size. Unlike atoi this fails instead of wrapping when the
+// value does not fit in 64 bits. Returns 1 on success.
+int parse_size(const char* s, long long* out) {
+    long long v = 0;
+    if (!isdigit((unsigned char)*s)) return 0;
+    while (isdigit((unsigned char)*s)) {
+        int d = *s++ - '0';
+        if (v > (LLONG_MAX - d) / 10) return 0;
+        v = v * 10 + d;
+    }
+    *out = v;
+    return 1;
+}
+
+// Crash-safe job state for fleet runs (--jobs FILE). Every phase change and
+// every JOB_CHECKPOINT_BYTES of transfer appends one flushed line
+//   <device> job=<id> phase=<name> offset=<bytes> total=<bytes>
+// and the last line for a device wins, so a torn final line after a power
+// cut only loses the newest checkpoint. The log is rewritten to one line per
+// device when it is opened and after JOB_COMPACT_RECORDS appends. A job is
+// identified by a hash of URL and local file; a different job on the same
+// device starts over.
+enum {
+    JOB_NEW,
+    JOB_DOWNLOAD,   // offset = bytes of the image on disk
+    JOB_UPLOAD,     // image complete ('total' bytes); offset = LFOTA progress
+    JOB_CFOTA,      // AT+CRESET sent, update running
+    JOB_VERIFY,     // update reported success
+    JOB_DONE,
+    JOB_PHASES
+};
+
+static const char* const job_phase_names[JOB_PHASES] = { "new", "download", "upload", "cfota", "verify", "done" };
+
+typedef struct {
+    char device[128];
+    unsigned long long id;
+    int phase;
+    long long offset;
+    long long total;
+    char validator[128];    // ETag or Last-Modified of the image being downloaded
+    long long base;     // offset the running transfer started from (not stored)
+    long long saved;    // offset of the last durable checkpoint (not stored)
+} Job;
+
+typedef struct {
+    CRITICAL_SECTION lock;
+    char path[MAX_PATH];
+    FILE* log;
+    int appended;
+    Job jobs[JOB_MAX_DEVICES];
+    int count;
+} JobStore;
+
+static JobStore g_jobs;
+static __declspec(thread) Job* t_job;
+
+static unsigned long long job_hash(unsigned long long h, const char* s) {
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h * 1099511628211ULL;    // separator, so "ab"+"c" != "a"+"bc"
+}
+
+// The validator may contain spaces (an HTTP date), so it goes last and runs to the end of the line.
+static void job_write(FILE* f, const Job* j) {
+    fprintf(f, "%s job=%016llx phase=%s offset=%lld total=%lld", j->device, j->id, job_phase_names[j->phase],
+        j->offset, j->total);
+    if (j->validator[0]) fprintf(f, " validator=%s", j->validator);
+    fprintf(f, "\n");
+}
+
+// Rewrite the log as one line per device: temp file, flushed to disk, then
+// renamed over the old one. Caller holds the lock.
+static int job_store_compact(void) {
+    char tmp_path[MAX_PATH];
+    FILE* out = NULL;
+    int ok;
+
+    if (g_jobs.log) {
+        fclose(g_jobs.log);
+        g_jobs.log = NULL;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_jobs.path);
+    if (fopen_s(&out, tmp_path, "w") != 0) return 0;
+    for (int i = 0; i < g_jobs.count; ++i) job_write(out, &g_jobs.jobs[i]);
+    ok = fflush(out) == 0 && _commit(_fileno(out)) == 0;
+    fclose(out);
+    ok = ok && MoveFileExA(tmp_path, g_jobs.path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    g_jobs.appended = 0;
+    return fopen_s(&g_jobs.log, g_jobs.path, "a") == 0 && ok;
+}
+
+static Job* job_find(const char* device) {
+    for (int i = 0; i < g_jobs.count; ++i) {
+        if (_stricmp(g_jobs.jobs[i].device, device) == 0) return &g_jobs.jobs[i];
+    }
+    Job* j = NULL;
+    if (g_jobs.count < JOB_MAX_DEVICES) j = &g_jobs.jobs[g_jobs.count++];
+    for (int i = 0; !j && i < g_jobs.count; ++i) {
+        if (g_jobs.jobs[i].phase == JOB_DONE) j = &g_jobs.jobs[i];     // full: reuse a finished one
+    }
+    if (!j) return NULL;
+    memset(j, 0, sizeof(*j));
+    snprintf(j->device, sizeof(j->device), "%s", device);
+    return j;
+}
+
+// Load the job log at 'path' and compact it. Returns 1 on success.
+int job_store_open(const char* path) {
+    FILE* f = NULL;
+    char line[512];
+
+    InitializeCriticalSection(&g_jobs.lock);
+    snprintf(g_jobs.path, sizeof(g_jobs.path), "%s", path);
+    if (fopen_s(&f, path, "r") == 0) {
+        while (fgets(line, sizeof(line), f)) {
+            char* next = NULL;
+            if (!strchr(line, '\n')) break;     // torn last line
+            char* tok = strtok_s(line, " \t\r\n", &next);
+            if (!tok) continue;
+            Job* j = job_find(tok);
+            if (!j) continue;
+            while ((tok = strtok_s(NULL, " \t\r\n", &next)) != NULL) {
+                char* eq = strchr(tok, '=');
+                if (!eq) continue;
+                *eq++ = '\0';
+                if (strcmp(tok, "job") == 0) j->id = _strtoui64(eq, NULL, 16);
+                else if (strcmp(tok, "offset") == 0) parse_size(eq, &j->offset);
+                else if (strcmp(tok, "total") == 0) parse_size(eq, &j->total);
+                else if (strcmp(tok, "validator") == 0) {
+                    next[strcspn(next, "\r\n")] = '\0';
+                    snprintf(j->validator, sizeof(j->validator), next[0] ? "%s %s" : "%s", eq, next);
+                    break;
+                }
+                else if (strcmp(tok, "phase") == 0) {
+                    for (int p = 0; p < JOB_PHASES; ++p) {
+                        if (strcmp(eq, job_phase_names[p]) == 0) j->phase = p;
+                    }
+                }
+            }
+        }
+        fclose(f);
+    }
+    return job_store_compact();
+}
+
+void job_store_close(void) {
+    if (!g_jobs.path[0]) return;
+    EnterCriticalSection(&g_jobs.lock);
+    job_store_compact();
+    fclose(g_jobs.log);
+    g_jobs.log = NULL;
+    LeaveCriticalSection(&g_jobs.lock);
+}
+
+// Bind the calling thread to the job for 'device'. Returns its state, reset
+// to JOB_NEW when the device last ran a different URL or file, or NULL when
+// the store is full.
+Job* job_attach(const char* device, const char* url, const char* filename) {
+    unsigned long long id = job_hash(job_hash(14695981039346656037ULL, url), filename);
+    EnterCriticalSection(&g_jobs.lock);
+    Job* j = job_find(device);
+    if (j && j->id != id) {
+        j->id = id;
+        j->phase = JOB_NEW;
+        j->offset = 0;
+        j->total = 0;
+        j->validator[0] = '\0';
+    }
+    LeaveCriticalSection(&g_jobs.lock);
+    t_job = j;
+    return j;
+}
+
+// Remember which version of the image the thread's job is downloading; the
+// next job_phase() makes it durable.
+void job_validator(const char* validator) {
+    Job* j = t_job;
+    if (!j) return;
+    EnterCriticalSection(&g_jobs.lock);
+    snprintf(j->validator, sizeof(j->validator), "%s", validator);
+    LeaveCriticalSection(&g_jobs.lock);
+}
+
+static void job_append(Job* j) {
+    EnterCriticalSection(&g_jobs.lock);
+    if (g_jobs.log) {
+        job_write(g_jobs.log, j);
+        fflush(g_jobs.log);
+        _commit(_fileno(g_jobs.log));
+        if (++g_jobs.appended >= JOB_COMPACT_RECORDS) job_store_compact();
+    }
+    LeaveCriticalSection(&g_jobs.lock);
+    j->saved = j->offset;
+}
+
+// Record that the thread's job entered 'phase'. 'offset' is where its
+// transfer starts; later checkpoints are relative to it.
+void job_phase(int phase, long long offset, long long total) {
+    Job* j = t_job;
+    if (!j) return;
+    j->phase = phase;
+    j->offset = offset;
+    j->base = offset;
+    j->total = total;
+    job_append(j);
+}
+
+// Transfer progress: 'done' bytes past the phase's start offset. Every
+// JOB_CHECKPOINT_BYTES the offset is made durable; 'data' (the file being
+// written, if any) is flushed to disk first so the log never runs ahead
+// of it; if that fails nothing is logged.
+void job_checkpoint(long long done, FILE* data) {
+    Job* j = t_job;
+    if (!j || j->base + done - j->saved < JOB_CHECKPOINT_BYTES) return;
+    if (data && (fflush(data) != 0 || _commit(_fileno(data)) != 0)) return;
+    j->offset = j->base + done;
+    job_append(j);
+}
+
+// Size of the file at 'path', or -1 if it cannot be opened.
+long long file_length(const char* path) {
+    FILE* f = NULL;
+    long long len = -1;
+    if (fopen_s(&f, path, "rb") != 0) return -1;
+    if (_fseeki64(f, 0, SEEK_END) == 0) len = _ftelli64(f);
+    fclose(f);
+    return len;
+}
+
+// Progress reporting shared by download, LFOTA upload and CFOTA. Callers
+// report absolute progress as often as they like (per chunk or block); the
+// engine only reads the clock there and redraws at a fixed low rate: a single
+// status line on a console, or one JSON object per line when stdout is
+// redirected. Throughput is an EWMA of per-redraw samples.
+typedef struct {
+    const char* label;
+    const char* unit;       // "B" for byte counts, "%" for percentages
+    long long total;        // 0 if unknown
+    long long done;
+    double rate;            // smoothed units per second
+    LONGLONG start_us;
+    LONGLONG last_sample_us;
+    long long last_sample_done;
+    int tty;
+    int drawn;
+} Progress;
+
+void progress_begin(Progress* p, const char* label, const char* unit, long long total) {
+    memset(p, 0, sizeof(*p));
+    p->label = label;
+    p->unit = unit;
+    p->total = total;
+    p->start_us = mono_now_us();
+    p->last_sample_us = p->start_us;
+    p->tty = _isatty(_fileno(stdout));
+}
+
+static void progress_draw(Progress* p, LONGLONG now, int final) {
+    double elapsed = (double)(now - p->start_us) / 1000000.0;
+    double eta = -1.0;
+    if (p->total > 0 && p->rate > 0.0 && p->done < p->total) eta = (double)(p->total - p->done) / p->rate;
+    if (g_log_level < LOG_PROGRESS) return;
+
+    if (!p->tty) {
+        printf("{\"progress\":\"%s\",\"done\":%lld,\"total\":%lld,\"unit\":\"%s\",\"rate\":%.1f,\"elapsed_s\":%.1f,\"eta_s\":%.1f%s}\n",
+            p->label, p->done, p->total, p->unit, p->rate, elapsed, eta, final ? ",\"final\":true" : "");
+        return;
+    }
+
+    char line[128];
+    int n;
+    if (p->total > 0) {
+        n = snprintf(line, sizeof(line), "\r[%s] %5.1f%% %lld/%lld %s", p->label,
+            (double)p->done * 100.0 / (double)p->total, p->done, p->total, p->unit);
+    }
+    else {
+        n = snprintf(line, sizeof(line), "\r[%s] %lld %s", p->label, p->done, p->unit);
+    }
+    if (strcmp(p->unit, "B") == 0 && n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, "  %.1f KB/s", p->rate / 1024.0);
+    }
+    if (eta >= 0.0 && n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, "  ETA %02d:%02d", (int)eta / 60, (int)eta % 60);
+    }
+    else if (final && n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, "  %.1f s", elapsed);
+    }
+    // pad so a shorter redraw fully covers the previous one
+    printf("%-80s%s", line, final ? "\n" : "");
+    fflush(stdout);
+    p->drawn = 1;
+    g_status_line_open = !final;
+}
+
+// Report absolute progress. Cheap: one clock read unless a redraw is due.
+void progress_update(Progress* p, long long done) {
+    LONGLONG now = mono_now_us();
+    LONGLONG interval = p->tty ? PROGRESS_TTY_INTERVAL_US : PROGRESS_PIPE_INTERVAL_US;
+    p->done = done;
+    if (now - p->last_sample_us < interval) return;
+
+    double dt = (double)(now - p->last_sample_us) / 1000000.0;
+    double inst = (double)(done - p->last_sample_done) / dt;
+    p->rate = p->last_sample_done == 0 && p->rate == 0.0 ? inst
+        : PROGRESS_EWMA_ALPHA * inst + (1.0 - PROGRESS_EWMA_ALPHA) * p->rate;
+    p->last_sample_us = now;
+    p->last_sample_done = done;
+    progress_draw(p, now, 0);
+}
+
+void progress_end(Progress* p) {
+    LONGLONG now = mono_now_us();
+    double elapsed = (double)(now - p->start_us) / 1000000.0;
+    if (elapsed > 0.0) p->rate = (double)p->done / elapsed;
+    progress_draw(p, now, 1);
+}
+
+// Sample upload progress from the driver's output queue while a write is
+// pending or draining ('len' bytes were handed to WriteFile).
+void progress_from_out_queue(HANDLE hCom, Progress* p, long long len) {
+    COMSTAT comStat;
+    DWORD errors = 0;
+    if (!p || !ClearCommError(hCom, &errors, &comStat)) return;
+    if ((long long)comStat.cbOutQue <= len) progress_update(p, len - comStat.cbOutQue);
+}
+
+// Scheduling for the receive thread and the log writer: at "high" the
+// process runs in HIGH_PRIORITY_CLASS and the threads at TIME_CRITICAL
+// (base priority 15); "realtime" asks for REALTIME_PRIORITY_CLASS (31),
+// which Windows quietly lowers to high without the increase-base-priority
+// privilege. 'cpu' >= 0 pins the threads to that logical processor.
+enum { RX_PRIORITY_NORMAL, RX_PRIORITY_HIGH, RX_PRIORITY_REALTIME };
+
+typedef struct {
+    int priority;
+    int cpu;
+} ThreadPlacement;
+
+static ThreadPlacement g_rx_placement = { RX_PRIORITY_NORMAL, -1 };
+
+// Handle --rx-priority / --rx-cpu at argv[*i]. Returns 1 if consumed,
+// 0 if not one of these options, -1 on a bad value.
+int rx_placement_option(int argc, char** argv, int* i) {
+    if (strcmp(argv[*i], "--rx-priority") == 0 && *i + 1 < argc) {
+        const char* v = argv[++*i];
+        if (strcmp(v, "normal") == 0) g_rx_placement.priority = RX_PRIORITY_NORMAL;
+        else if (strcmp(v, "high") == 0) g_rx_placement.priority = RX_PRIORITY_HIGH;
+        else if (strcmp(v, "realtime") == 0) g_rx_placement.priority = RX_PRIORITY_REALTIME;
+        else {
+            printf("Unknown receive priority '%s' (normal, high, realtime)\n", v);
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(argv[*i], "--rx-cpu") == 0 && *i + 1 < argc) {
+        g_rx_placement.cpu = atoi(argv[++*i]);
+        if (g_rx_placement.cpu < 0 || g_rx_placement.cpu >= (int)(sizeof(DWORD_PTR) * 8)) {
+            printf("CPU index out of range: %s\n", argv[*i]);
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Apply g_rx_placement to 'thread'; 'name' is for the log line.
+void thread_place(HANDLE thread, const char* name) {
+    const ThreadPlacement* p = &g_rx_placement;
+    if (p->priority != RX_PRIORITY_NORMAL) {
+        DWORD want = p->priority == RX_PRIORITY_REALTIME ? REALTIME_PRIORITY_CLASS : HIGH_PRIORITY_CLASS;
+        if (GetPriorityClass(GetCurrentProcess()) != want) SetPriorityClass(GetCurrentProcess(), want);
+        if (!SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL)) {
+            log_printf(LOG_PROGRESS, "Unable to raise %s thread priority\n", name);
+        }
+        if (p->priority == RX_PRIORITY_REALTIME && GetPriorityClass(GetCurrentProcess()) != REALTIME_PRIORITY_CLASS) {
+            log_printf(LOG_PROGRESS, "Real-time priority class not granted (run as administrator); using high\n");
+        }
+    }
+    if (p->cpu >= 0) {
+        if (!SetThreadAffinityMask(thread, (DWORD_PTR)1 << p->cpu)) {
+            log_printf(LOG_PROGRESS, "Unable to pin %s thread to CPU %d\n", name, p->cpu);
+        }
+    }
+}
+
+// Asynchronous binary logger. Producers (the data path) append fixed-size
+// records to their own single-producer/single-consumer ring and never block:
+// when a ring is full the record is counted as dropped. Text longer than a
+// record holds continues in the following slots, which carry nothing but
+// text. A background thread drains all rings and writes text, JSON lines or
+// raw records.
+enum {
+    EV_COMMAND_SENT,
+    EV_LINE_RECEIVED,
+    EV_CHUNK,
+    EV_RING_FULL,
+    EV_DRAIN_COMPLETE,
+    EV_CFOTA_PROGRESS,
+    EV_COUNT
+};
+
+static const char* const alog_event_names[EV_COUNT] = {
+    "command_sent", "line_received", "chunk", "ring_full", "drain_complete", "cfota_progress"
+};
+
+enum { ALOG_TEXT, ALOG_JSON, ALOG_RAW };
+
+typedef struct {
+    LONGLONG ts_us;
+    DWORD tid;
+    unsigned short id;
+    unsigned short text_len;
+    long long args[2];
+    char text[ALOG_TEXT_BYTES];
+} AlogRecord;
+
+typedef struct {
+    AlogRecord records[ALOG_RING_RECORDS];
+    volatile LONG head;     // next slot to write (producer)
+    volatile LONG tail;     // next slot to read (consumer)
+    volatile LONG dropped;
+    volatile LONG truncated;
+} AlogRing;
+
+typedef struct {
+    AlogRing* rings[ALOG_MAX_THREADS];
+    volatile LONG ring_count;
+    volatile int enabled;
+    volatile int running;
+    int format;
+    FILE* out;
+    LONGLONG origin_us;
+    HANDLE hThread;
+} AsyncLog;
+
+static AsyncLog g_alog;
+static __declspec(thread) AlogRing* t_alog_ring;
+static const char alog_raw_magic[8] = { 'S', 'I', 'M', 'A', 'L', 'O', 'G', '2' };
+
+// Slots a record with 'text_len' bytes of text occupies.
+static int alog_slots(int text_len) {
+    int rest = text_len - ALOG_TEXT_BYTES;
+    return rest > 0 ? 1 + (rest + (int)sizeof(AlogRecord) - 1) / (int)sizeof(AlogRecord) : 1;
+}
+
+// Hot path: record an event. Never blocks and never allocates after the
+// calling thread's first event.
+void alog_event(int id, long long a0, long long a1, const char* text, int text_len) {
+    if (!g_alog.enabled) return;
+    AlogRing* ring = t_alog_ring;
+    if (!ring) {
+        LONG idx = InterlockedIncrement(&g_alog.ring_count) - 1;
+        if (idx >= ALOG_MAX_THREADS) {
+            InterlockedDecrement(&g_alog.ring_count);
+            return;
+        }
+        ring = (AlogRing*)heap_alloc(sizeof(AlogRing));
+        if (!ring) return;
+        memset(ring, 0, sizeof(*ring));
+        t_alog_ring = ring;
+        InterlockedExchangePointer((PVOID volatile*)&g_alog.rings[idx], ring);
+    }
+    if (text_len < 0) text_len = 0;
+    if (text_len > ALOG_MAX_TEXT) {
+        text_len = ALOG_MAX_TEXT;
+        InterlockedIncrement(&ring->truncated);
+    }
+    int slots = alog_slots(text_len);
+    LONG head = ring->head;
+    if (head - ring->tail > ALOG_RING_RECORDS - slots) {
+        InterlockedIncrement(&ring->dropped);
+        return;
+    }
+    AlogRecord* r = &ring->records[head & (ALOG_RING_RECORDS - 1)];
+    r->ts_us = mono_now_us();
+    r->tid = GetCurrentThreadId();
+    r->id = (unsigned short)id;
+    r->args[0] = a0;
+    r->args[1] = a1;
+    r->text_len = (unsigned short)text_len;
+    int n = text_len < ALOG_TEXT_BYTES ? text_len : ALOG_TEXT_BYTES;
+    if (n) memcpy(r->text, text, n);
+    for (int i = 1; i < slots; ++i) {
+        int chunk = text_len - n < (int)sizeof(AlogRecord) ? text_len - n : (int)sizeof(AlogRecord);
+        memcpy(&ring->records[(head + i) & (ALOG_RING_RECORDS - 1)], text + n, chunk);
+        n += chunk;
+    }
+    InterlockedExchange(&ring->head, head + slots); // publish
+}
+
+// Write one record whose (reassembled) text is in 'text', r->text_len bytes.
+static void alog_format(FILE* out, int format, const AlogRecord* r, char* text, LONGLONG origin_us) {
+    double t = (double)(r->ts_us - origin_us) / 1000000.0;
+    int n = r->text_len;
+    while (n > 0 && (text[n - 1] == '\r' || text[n - 1] == '\n')) n--;
+    text[n] = '\0';
+    if (format == ALOG_JSON) {
+        fprintf(out, "{\"t\":%.6f,\"tid\":%lu,\"event\":\"%s\",\"a0\":%lld,\"a1\":%lld,\"text\":",
+            t, (unsigned long)r->tid, r->id < EV_COUNT ? alog_event_names[r->id] : "unknown", r->args[0], r->args[1]);
+        json_write_string(out, text);
+        fprintf(out, "}\n");
+    }
+    else {
+        fprintf(out, "%12.6f [%5lu] %-15s %lld %lld %s\n", t, (unsigned long)r->tid,
+            r->id < EV_COUNT ? alog_event_names[r->id] : "unknown", r->args[0], r->args[1], text);
+    }
+}
+
+// Drain every ring once. Returns the number of records written.
+static int alog_drain(void) {
+    int written = 0;
+    LONG count = g_alog.ring_count;
+    if (count > ALOG_MAX_THREADS) count = ALOG_MAX_THREADS;
+    for (LONG i = 0; i < count; ++i) {
+        AlogRing* ring = g_alog.rings[i];
+        if (!ring) continue;
+        LONG head = InterlockedCompareExchange(&ring->head, 0, 0);
+        LONG tail = ring->tail;
+        while (tail != head) {
+            const AlogRecord* r = &ring->records[tail & (ALOG_RING_RECORDS - 1)];
+            int slots = alog_slots(r->text_len);
+            if (g_alog.format == ALOG_RAW) {
+                for (int k = 0; k < slots; ++k) fwrite(&ring->records[(tail + k) & (ALOG_RING_RECORDS - 1)], sizeof(*r), 1, g_alog.out);
+            }
+            else {
+                char text[ALOG_MAX_TEXT + 1];
+                int n = r->text_len < ALOG_TEXT_BYTES ? r->text_len : ALOG_TEXT_BYTES;
+                memcpy(text, r->text, n);
+                for (int k = 1; k < slots; ++k) {
+                    int chunk = r->text_len - n < (int)sizeof(*r) ? r->text_len - n : (int)sizeof(*r);
+                    memcpy(text + n, &ring->records[(tail + k) & (ALOG_RING_RECORDS - 1)], chunk);
+                    n += chunk;
+                }
+                alog_format(g_alog.out, g_alog.format, r, text, g_alog.origin_us);
+            }
+            tail += slots;
+            written++;
+        }
+        InterlockedExchange(&ring->tail, tail);
+    }
+    return written;
+}
+
+static DWORD WINAPI alog_thread(LPVOID param) {
+    (void)param;
+    while (g_alog.running) {
+        if (alog_drain() == 0) Sleep(10);
+    }
+    alog_drain();
+    return 0;
+}
+
+// Start the logger writing to 'path' in the given format. Returns 1 on success.
+int alog_start(const char* path, int format) {
+    memset(&g_alog, 0, sizeof(g_alog));
+    if (fopen_s(&g_alog.out, path, format == ALOG_RAW ? "wb" : "w") != 0) {
+        printf("Unable to create log file %s\n", path);
+        return 0;
+    }
+    g_alog.format = format;
+    g_alog.origin_us = mono_now_us();
+    if (format == ALOG_RAW) {
+        unsigned int rec_size = (unsigned int)sizeof(AlogRecord);
+        fwrite(alog_raw_magic, 1, sizeof(alog_raw_magic), g_alog.out);
+        fwrite(&rec_size, sizeof(rec_size), 1, g_alog.out);
+        fwrite(&g_alog.origin_us, sizeof(g_alog.origin_us), 1, g_alog.out);
+    }
+    g_alog.running = 1;
+    g_alog.hThread = CreateThread(NULL, 0, alog_thread, NULL, 0, NULL);
+    if (!g_alog.hThread) {
+        fclose(g_alog.out);
+        return 0;
+    }
+    thread_place(g_alog.hThread, "log writer");
+    g_alog.enabled = 1;
+    return 1;
+}
+
+void alog_stop(void) {
+    if (!g_alog.enabled) return;
+    g_alog.enabled = 0;
+    g_alog.running = 0;
+    WaitForSingleObject(g_alog.hThread, INFINITE);
+    CloseHandle(g_alog.hThread);
+    LONG dropped = 0;
+    LONG truncated = 0;
+    for (LONG i = 0; i < g_alog.ring_count && i < ALOG_MAX_THREADS; ++i) {
+        if (g_alog.rings[i]) dropped += g_alog.rings[i]->dropped;
+        if (g_alog.rings[i]) truncated += g_alog.rings[i]->truncated;
+    }
+    if (dropped && g_alog.format != ALOG_RAW) fprintf(g_alog.out, "# %ld records dropped\n", (long)dropped);
+    if (truncated && g_alog.format != ALOG_RAW) fprintf(g_alog.out, "# %ld records truncated\n", (long)truncated);
+    fclose(g_alog.out);
+    if (dropped) printf("Async log: %ld records dropped\n", (long)dropped);
+    if (truncated) printf("Async log: %ld records truncated to %d bytes\n", (long)truncated, ALOG_MAX_TEXT);
+}
+
+// Convert a raw log written with --log-format raw to text. Returns 1 on success.
+int alog_decode(const char* in_path, FILE* out) {
+    FILE* in;
+    char magic[8];
+    unsigned int rec_size = 0;
+    LONGLONG origin_us = 0;
+    AlogRecord r;
+    char text[ALOG_MAX_TEXT + 1];
+    if (fopen_s(&in, in_path, "rb") != 0) {
+        printf("Unable to open %s\n", in_path);
+        return 0;
+    }
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, alog_raw_magic, sizeof(magic)) != 0 ||
+        fread(&rec_size, sizeof(rec_size), 1, in) != 1 || rec_size != sizeof(AlogRecord) ||
+        fread(&origin_us, sizeof(origin_us), 1, in) != 1) {
+        printf("%s is not a raw log from this build\n", in_path);
+        fclose(in);
+        return 0;
+    }
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        if (r.text_len > ALOG_MAX_TEXT) r.text_len = ALOG_MAX_TEXT;
+        int n = r.text_len < ALOG_TEXT_BYTES ? r.text_len : ALOG_TEXT_BYTES;
+        memcpy(text, r.text, n);
+        for (int k = 1; k < alog_slots(r.text_len); ++k) {
+            AlogRecord more;
+            if (fread(&more, sizeof(more), 1, in) != 1) break;
+            int chunk = r.text_len - n < (int)sizeof(more) ? r.text_len - n : (int)sizeof(more);
+            memcpy(text + n, &more, chunk);
+            n += chunk;
+        }
+        r.text_len = (unsigned short)n;
+        alog_format(out, ALOG_TEXT, &r, text, origin_us);
+    }
+    fclose(in);
+    return 1;
+}
+
+// Log a received response line: to the async log when enabled, otherwise to
+// the console at protocol level.
+void log_rx_line(const char* line) {
+    if (g_alog.enabled) {
+        int len = (int)strlen(line);
+        alog_event(EV_LINE_RECEIVED, len, 0, line, len);
+        return;
+    }
+    log_printf(LOG_PROTOCOL, "Received: %s", line);
+}
+
+// Drop up to 'length' bytes from the buffer without copying them. Returns bytes dropped.
+int ring_buffer_discard(RingBuffer* rb, int length) {
+    EnterCriticalSection(&rb->lock);
+    int toDrop = length < rb->count ? length : rb->count;
+    if (toDrop > 0) {
+        rb->tail = (rb->tail + toDrop) % RING_BUFFER_SIZE;
+        rb->count -= toDrop;
+    }
+    LeaveCriticalSection(&rb->lock);
+    return toDrop > 0 ? toDrop : 0;
+}
+
+// Contiguous free space at the head of 'rb'. The receive thread reads
+// straight into it and then publishes the bytes with ring_buffer_commit.
+// Only the single producer moves head, so the span stays valid meanwhile.
+int ring_buffer_write_span(RingBuffer* rb, char** span) {
+    EnterCriticalSection(&rb->lock);
+    int space = RING_BUFFER_SIZE - rb->count;
+    int contiguous = RING_BUFFER_SIZE - rb->head;
+    *span = rb->buffer + rb->head;
+    LeaveCriticalSection(&rb->lock);
+    return space < contiguous ? space : contiguous;
+}
+
+void ring_buffer_commit(RingBuffer* rb, int length) {
+    EnterCriticalSection(&rb->lock);
+    rb->head = (rb->head + length) % RING_BUFFER_SIZE;
+    rb->count += length;
+    LeaveCriticalSection(&rb->lock);
+    SetEvent(rb->dataEvent);
+}
+
+// Block until new bytes arrive in 'rb' or 'deadline' expires, whichever is
+// first (at most 'max_ms' when non-zero; only 'max_ms' without a deadline).
+// Time spent counts as polling sleep.
+void ring_buffer_wait(RingBuffer* rb, const Timer* deadline, DWORD max_ms) {
+    DWORD ms = deadline ? deadline_remaining_ms(deadline) : max_ms;
+    if (max_ms && ms > max_ms) ms = max_ms;
+    if (ms == 0) return;
+    LONGLONG start = mono_now_us();
+    WaitForSingleObject(rb->dataEvent, ms);
+    metrics_add(MET_POLL_SLEEP_US, mono_now_us() - start);
+}
+
+// Try to cancel an overlapped I/O operation. Prefer CancelIoEx when available,
+// fall back to CancelIo which cancels all pending I/O for the thread.
+int try_cancel_overlapped(HANDLE hCom, LPOVERLAPPED pov) {
+    typedef BOOL(WINAPI* PCANCELIOEX)(HANDLE, LPOVERLAPPED);
+    HMODULE h = GetModuleHandleA("kernel32.dll");
+    if (h) {
+        PCANCELIOEX p = (PCANCELIOEX)GetProcAddress(h, "CancelIoEx");
+        if (p) {
+            if (p(hCom, pov)) return 1;
+            return 0;
+        }
+    }
+    // Fallback
+    CancelIo(hCom);
+    return 1;
+}
+
+// Wait for either a specific pattern anywhere in the receive buffer OR a full
+// line (ending with '\n'). If 'pattern' is found this returns 1 and places
+// the consumed bytes (up to pattern end) into 'out' (null-terminated). If a
+// full line is available but the pattern wasn't found, it consumes that line
+// and returns 2 and places the line into 'out'. Returns 0 on timeout.
+int wait_for_pattern_or_line(RingBuffer* rb, const char* pattern, char* out, int out_size, int timeout_ms) {
+    Timer deadline;
+    int pat_len = (int)strlen(pattern);
+    if (out_size <= 0) return 0;
+
+    deadline_start(&deadline, (DWORD)timeout_ms);
+    while (!deadline_expired(&deadline)) {
+        int avail = ring_buffer_available(rb);
+        if (avail > 0) {
+            int toCopy = avail > RING_BUFFER_SIZE ? RING_BUFFER_SIZE : avail;
+            // copy into temp buffer using peek
+            char tmp[RING_BUFFER_SIZE + 1];
+            int i;
+            for (i = 0; i < toCopy; ++i) {
+                ring_buffer_peek(rb, i, &tmp[i]);
+            }
+            tmp[toCopy] = '\0';
+
+            // search for pattern
+            char* p = strstr(tmp, pattern);
+            if (p) {
+                int pos = (int)(p - tmp);
+                int consume = pos + pat_len;
+                int toRead = consume < (out_size - 1) ? consume : (out_size - 1);
+                int n = ring_buffer_read_bulk(rb, out, toRead);
+                out[n] = '\0';
+                deadline_cancel(&deadline);
+                return 1; // pattern found
+            }
+
+            // if there's a newline, return that line
+            char* nl = strchr(tmp, '\n');
+            if (nl) {
+                int pos = (int)(nl - tmp) + 1;
+                int toRead = pos < (out_size - 1) ? pos : (out_size - 1);
+                int n = ring_buffer_read_bulk(rb, out, toRead);
+                out[n] = '\0';
+                deadline_cancel(&deadline);
+                return 2; // returned a line (no pattern)
+            }
+        }
+        ring_buffer_wait(rb, &deadline, 0);
+    }
+    return 0; // timeout
+}
+
+// Network ports: "tcp://host:port" is a raw TCP serial server (socat,
+// ser2net raw mode), "rfc2217://host:port" a Telnet COM-PORT-OPTION server
+// that also takes the baud rate and flow control. The connected socket is
+// overlapped and stands in for the port HANDLE, so ReadFile/WriteFile and
+// the rest of the I/O path are unchanged; the comm-only calls (DCB,
+// timeouts, queue status) are skipped for it. On an RFC 2217 link data
+// bytes 0xFF are doubled on the way out and Telnet commands are stripped
+// from the received stream.
+enum { NET_RAW = 1, NET_RFC2217 = 2 };
+
+enum {
+    TN_SE = 240,
+    TN_SB = 250,
+    TN_WILL = 251,
+    TN_WONT = 252,
+    TN_DO = 253,
+    TN_DONT = 254,
+    TN_IAC = 255,
+    TN_OPT_BINARY = 0,
+    TN_OPT_SGA = 3,
+    TN_OPT_COMPORT = 44,
+    CPO_SET_BAUDRATE = 1,
+    CPO_SET_DATASIZE = 2,
+    CPO_SET_PARITY = 3,
+    CPO_SET_STOPSIZE = 4,
+    CPO_SET_CONTROL = 5,
+    CPO_SET_LINESTATE_MASK = 10,
+    CPO_NOTIFY_LINESTATE = 106,     // server replies carry the command + 100
+};
+
+enum { TS_DATA, TS_IAC, TS_OPT, TS_SB, TS_SB_IAC };
+
+typedef struct {
+    void* volatile h;           // socket handle, NULL when the slot is free
+    int kind;
+    int rx_state;               // Telnet parser state, carried across reads
+    unsigned char rx_cmd;
+    unsigned char sb[3];        // first bytes of the current subnegotiation
+    int sb_len;
+    unsigned char will[32];     // options answered with WILL/WONT (bitmap)
+    unsigned char do_[32];      // options answered with DO/DONT
+} NetLink;
+
+static NetLink g_net_links[NET_MAX_LINKS];
+
+int net_port_kind(const char* portName) {
+    if (_strnicmp(portName, "tcp://", 6) == 0) return NET_RAW;
+    if (_strnicmp(portName, "rfc2217://", 10) == 0) return NET_RFC2217;
+    return 0;
+}
+
+// The link for a port handle, or NULL for a local COM port.
+NetLink* net_link(HANDLE h) {
+    for (int i = 0; i < NET_MAX_LINKS; ++i) {
+        if (g_net_links[i].h == h) return &g_net_links[i];
+    }
+    return NULL;
+}
+
+static int net_send_all(HANDLE h, const unsigned char* buf, int len) {
+    while (len > 0) {
+        int n = send((SOCKET)h, (const char*)buf, len, 0);
+        if (n <= 0) return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Double every IAC in place. 'buf' holds 'len' bytes and has room for 2 * len.
+DWORD net_escape(char* buf, DWORD len) {
+    DWORD extra = 0;
+    for (DWORD i = 0; i < len; ++i) {
+        if ((unsigned char)buf[i] == TN_IAC) extra++;
+    }
+    if (extra == 0) return len;
+    DWORD out = len + extra;
+    for (DWORD i = len, o = out; i-- > 0;) {
+        buf[--o] = buf[i];
+        if ((unsigned char)buf[i] == TN_IAC) buf[--o] = buf[i];
+    }
+    return out;
+}
+
+static int net_bit(unsigned char* map, unsigned char opt) {
+    int was = (map[opt >> 3] >> (opt & 7)) & 1;
+    map[opt >> 3] |= (unsigned char)(1 << (opt & 7));
+    return was;
+}
+
+// Answer a server's option request once: binary, suppress-go-ahead and
+// COM-PORT-OPTION are accepted, anything else refused.
+static void net_negotiate(NetLink* l, unsigned char cmd, unsigned char opt) {
+    unsigned char reply[3] = { TN_IAC, 0, opt };
+    int wanted = opt == TN_OPT_BINARY || opt == TN_OPT_SGA || opt == TN_OPT_COMPORT;
+    if (cmd == TN_DO && !net_bit(l->will, opt)) reply[1] = wanted ? TN_WILL : TN_WONT;
+    else if (cmd == TN_WILL && !net_bit(l->do_, opt)) reply[1] = wanted && opt != TN_OPT_COMPORT ? TN_DO : TN_DONT;
+    if (reply[1]) net_send_all((HANDLE)l->h, reply, sizeof(reply));
+}
+
+// Strip Telnet commands from 'len' received bytes in place; returns the
+// number of data bytes left. Line-state notifications with overrun,
+// parity or framing errors count as line errors.
+int net_rx_filter(NetLink* l, char* buf, int len) {
+    unsigned char* p = (unsigned char*)buf;
+    int out = 0;
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = p[i];
+        switch (l->rx_state) {
+        case TS_DATA:
+            if (c == TN_IAC) l->rx_state = TS_IAC;
+            else p[out++] = c;
+            break;
+        case TS_IAC:
+            if (c == TN_IAC) {
+                p[out++] = c;
+                l->rx_state = TS_DATA;
+            }
+            else if (c >= TN_WILL && c <= TN_DONT) {
+                l->rx_cmd = c;
+                l->rx_state = TS_OPT;
+            }
+            else if (c == TN_SB) {
+                l->sb_len = 0;
+                l->rx_state = TS_SB;
+            }
+            else {
+                l->rx_state = TS_DATA;
+            }
+            break;
+        case TS_OPT:
+            net_negotiate(l, l->rx_cmd, c);
+            l->rx_state = TS_DATA;
+            break;
+        case TS_SB:
+            if (c == TN_IAC) l->rx_state = TS_SB_IAC;
+            else if (l->sb_len < 3) l->sb[l->sb_len++] = c;
+            break;
+        case TS_SB_IAC:
+            if (c == TN_SE) {
+                if (l->sb_len == 3 && l->sb[0] == TN_OPT_COMPORT && l->sb[1] == CPO_NOTIFY_LINESTATE &&
+                    (l->sb[2] & 0x0E)) {
+                    metrics_add(MET_LINE_ERRORS, 1);
+                    if (l->sb[2] & 0x02) metrics_add(MET_OVERRUNS, 1);
+                }
+                l->rx_state = TS_DATA;
+            }
+            else {
+                if (c == TN_IAC && l->sb_len < 3) l->sb[l->sb_len++] = c;
+                l->rx_state = TS_SB;
+            }
+            break;
+        }
+    }
+    return out;
+}
+
+static int net_sb_put(unsigned char* out, int pos, unsigned char b) {
+    out[pos++] = b;
+    if (b == TN_IAC) out[pos++] = b;
+    return pos;
+}
+
+// One COM-PORT-OPTION subnegotiation: IAC SB 44 <cmd> <value...> IAC SE.
+static int net_sb(unsigned char* out, int pos, unsigned char cmd, const unsigned char* value, int len) {
+    out[pos++] = TN_IAC;
+    out[pos++] = TN_SB;
+    out[pos++] = TN_OPT_COMPORT;
+    out[pos++] = cmd;
+    for (int i = 0; i < len; ++i) pos = net_sb_put(out, pos, value[i]);
+    out[pos++] = TN_IAC;
+    out[pos++] = TN_SE;
+    return pos;
+}
+
+// Offer binary mode and COM-PORT-OPTION, then set 8-N-1 at 'baudRate' with
+// the profile's flow control, DTR/RTS on, and ask for line-state errors.
+static int rfc2217_configure(NetLink* l, int baudRate) {
+    unsigned char out[128];
+    int pos = 0;
+    const unsigned char offer[] = {
+        TN_IAC, TN_WILL, TN_OPT_BINARY, TN_IAC, TN_DO, TN_OPT_BINARY,
+        TN_IAC, TN_WILL, TN_OPT_SGA, TN_IAC, TN_DO, TN_OPT_SGA,
+        TN_IAC, TN_WILL, TN_OPT_COMPORT,
+    };
+    unsigned char baud[4] = {
+        (unsigned char)(baudRate >> 24), (unsigned char)(baudRate >> 16),
+        (unsigned char)(baudRate >> 8), (unsigned char)baudRate,
+    };
+    unsigned char v;
+    memcpy(out, offer, sizeof(offer));
+    pos = sizeof(offer);
+    net_bit(l->will, TN_OPT_BINARY);
+    net_bit(l->will, TN_OPT_SGA);
+    net_bit(l->will, TN_OPT_COMPORT);
+    net_bit(l->do_, TN_OPT_BINARY);
+    net_bit(l->do_, TN_OPT_SGA);
+    pos = net_sb(out, pos, CPO_SET_BAUDRATE, baud, 4);
+    v = 8;
+    pos = net_sb(out, pos, CPO_SET_DATASIZE, &v, 1);
+    v = 1;  // none
+    pos = net_sb(out, pos, CPO_SET_PARITY, &v, 1);
+    v = 1;  // one stop bit
+    pos = net_sb(out, pos, CPO_SET_STOPSIZE, &v, 1);
+    v = g_profile.rtscts ? 3 : 1;   // hardware / no outbound flow control
+    pos = net_sb(out, pos, CPO_SET_CONTROL, &v, 1);
+    v = 8;  // DTR on
+    pos = net_sb(out, pos, CPO_SET_CONTROL, &v, 1);
+    if (!g_profile.rtscts) {
+        v = 11; // RTS on
+        pos = net_sb(out, pos, CPO_SET_CONTROL, &v, 1);
+    }
+    v = 0x0E;   // overrun, parity and framing errors
+    pos = net_sb(out, pos, CPO_SET_LINESTATE_MASK, &v, 1);
+    return net_send_all((HANDLE)l->h, out, pos);
+}
+
+// Connect to "<scheme>://host:port". Returns the socket as a HANDLE, or
+// INVALID_HANDLE_VALUE. TCP_NODELAY keeps AT commands from waiting behind
+// Nagle; the large buffers keep a full LFOTA block in flight over the
+// network's round trip.
+HANDLE net_open(const char* portName, int kind, int baudRate) {
+    const char* spec = strstr(portName, "://") + 3;
+    const char* colon = strrchr(spec, ':');
+    char host[256];
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    WSADATA wsa;
+    SOCKET s = INVALID_SOCKET;
+    NetLink* link = NULL;
+    int nodelay = 1;
+    int bufsize = NET_SOCKET_BUFFER;
+
+    if (!colon || colon == spec || colon[1] == '\0') return INVALID_HANDLE_VALUE;
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        memmove(host, host + 1, strlen(host) - 2);
+        host[strlen(host) - 2] = '\0';
+    }
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return INVALID_HANDLE_VALUE;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        printf("Unable to resolve %s\n", host);
+        WSACleanup();
+        return INVALID_HANDLE_VALUE;
+    }
+    for (struct addrinfo* ai = res; ai && s == INVALID_SOCKET; ai = ai->ai_next) {
+        s = WSASocketW(ai->ai_family, ai->ai_socktype, ai->ai_protocol, NULL, 0, WSA_FLAG_OVERLAPPED);
+        if (s == INVALID_SOCKET) continue;
+        // Buffer sizes are set before connect so the window scale covers them
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&bufsize, sizeof(bufsize));
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&bufsize, sizeof(bufsize));
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+        if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) != 0) {
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(res);
+    if (s == INVALID_SOCKET) {
+        WSACleanup();
+        return INVALID_HANDLE_VALUE;
+    }
+
+    for (int i = 0; i < NET_MAX_LINKS && !link; ++i) {
+        if (InterlockedCompareExchangePointer((void* volatile*)&g_net_links[i].h, (void*)s, NULL) == NULL) {
+            link = &g_net_links[i];
+        }
+    }
+    if (!link) {
+        closesocket(s);
+        WSACleanup();
+        return INVALID_HANDLE_VALUE;
+    }
+    link->kind = kind;
+    link->rx_state = TS_DATA;
+    link->sb_len = 0;
+    memset(link->will, 0, sizeof(link->will));
+    memset(link->do_, 0, sizeof(link->do_));
+    if (kind == NET_RFC2217 && !rfc2217_configure(link, baudRate)) {
+        closesocket(s);
+        link->h = NULL;
+        WSACleanup();
+        return INVALID_HANDLE_VALUE;
+    }
+    return (HANDLE)s;
+}
+
+// Close a handle from open_serial_port.
+void close_serial_port(HANDLE hCom) {
+    NetLink* link = net_link(hCom);
+    if (!link) {
+        CloseHandle(hCom);
+        return;
+    }
+    closesocket((SOCKET)hCom);
+    link->h = NULL;
+    WSACleanup();
+}
+
+// Errors a read returns once the device behind the handle is gone: a USB
+// modem re-enumerating after AT+CRESET, or a network link reset.
+int serial_port_gone(DWORD err) {
+    return err == ERROR_ACCESS_DENIED || err == ERROR_BAD_COMMAND || err == ERROR_GEN_FAILURE ||
+        err == ERROR_DEVICE_NOT_CONNECTED || err == ERROR_FILE_NOT_FOUND || err == ERROR_INVALID_HANDLE ||
+        err == ERROR_NETNAME_DELETED;
+}
+
+// The COM ports that exist right now (HARDWARE\DEVICEMAP\SERIALCOMM).
+int serial_port_names(char names[][16], int max) {
+    HKEY key;
+    int n = 0;
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, "HARDWARE\\DEVICEMAP\\SERIALCOMM", 0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS) {
+        return 0;
+    }
+    for (DWORD i = 0; n < max; ++i) {
+        char value[256];
+        DWORD value_len = sizeof(value);
+        DWORD type = 0;
+        DWORD data_len = sizeof(names[n]) - 1;
+        memset(names[n], 0, sizeof(names[n]));
+        if (RegEnumValueA(key, i, value, &value_len, NULL, &type, (BYTE*)names[n], &data_len) != ERROR_SUCCESS) break;
+        if (type == REG_SZ) n++;
+    }
+    RegCloseKey(key);
+    return n;
+}
+
+// Local ports held by this process's sessions. In watch mode many units
+// reattach at once; none of them may probe or take another's port.
+static struct {
+    SRWLOCK lock;
+    char names[SERIAL_MAX_PORTS][16];
+    int count;
+} g_ports_held = { SRWLOCK_INIT };
+
+void port_hold(const char* name, int hold) {
+    if (net_port_kind(name)) return;
+    AcquireSRWLockExclusive(&g_ports_held.lock);
+    int i = 0;
+    while (i < g_ports_held.count && _stricmp(g_ports_held.names[i], name) != 0) i++;
+    if (hold && i == g_ports_held.count && i < SERIAL_MAX_PORTS) {
+        snprintf(g_ports_held.names[g_ports_held.count++], sizeof(g_ports_held.names[0]), "%s", name);
+    }
+    else if (!hold && i < g_ports_held.count) {
+        memmove(g_ports_held.names[i], g_ports_held.names[i + 1], (g_ports_held.count - i - 1) * sizeof(g_ports_held.names[0]));
+        g_ports_held.count--;
+    }
+    ReleaseSRWLockExclusive(&g_ports_held.lock);
+}
+
+int port_held(const char* name) {
+    int held = 0;
+    AcquireSRWLockExclusive(&g_ports_held.lock);
+    for (int i = 0; i < g_ports_held.count && !held; ++i) held = _stricmp(g_ports_held.names[i], name) == 0;
+    ReleaseSRWLockExclusive(&g_ports_held.lock);
+    return held;
+}
+
+static DWORD CALLBACK port_arrival_cb(HCMNOTIFICATION notify, PVOID context, CM_NOTIFY_ACTION action,
+    PCM_NOTIFY_EVENT_DATA data, DWORD size) {
+    if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL) SetEvent((HANDLE)context);
+    return ERROR_SUCCESS;
+}
+
+// Signal 'event' whenever a COM port interface arrives. CM_Register_Notification
+// needs Windows 8, so it is looked up at run time; without it the caller
+// just polls. Returns the registration to pass to port_arrival_unwatch.
+HCMNOTIFICATION port_arrival_watch(HANDLE event) {
+    typedef CONFIGRET(WINAPI* PCMREGISTER)(PCM_NOTIFY_FILTER, PVOID, PCM_NOTIFY_CALLBACK, PHCMNOTIFICATION);
+    static const GUID comport_interface = { 0x86E0D1E0, 0x8089, 0x11D0, { 0x9C, 0xE4, 0x08, 0x00, 0x3E, 0x30, 0x1F, 0x73 } };
+    HMODULE h = LoadLibraryA("cfgmgr32.dll");
+    HCMNOTIFICATION notify = NULL;
+    CM_NOTIFY_FILTER filter;
+    if (!h) return NULL;
+    PCMREGISTER p = (PCMREGISTER)GetProcAddress(h, "CM_Register_Notification");
+    memset(&filter, 0, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = comport_interface;
+    if (!p || p(&filter, event, port_arrival_cb, &notify) != CR_SUCCESS) notify = NULL;
+    return notify;
+}
+
+void port_arrival_unwatch(HCMNOTIFICATION notify) {
+    typedef CONFIGRET(WINAPI* PCMUNREGISTER)(HCMNOTIFICATION);
+    HMODULE h = notify ? GetModuleHandleA("cfgmgr32.dll") : NULL;
+    PCMUNREGISTER p = h ? (PCMUNREGISTER)GetProcAddress(h, "CM_Unregister_Notification") : NULL;
+    if (p) p(notify);
+}
+
+HANDLE open_serial_port(const char* portName, int baudRate);
+void close_serial_port(HANDLE hCom);
+
+// Ask whatever is behind a freshly opened port for its IMEI (AT+CGSN),
+// reading the handle directly since it is not the session's yet. Returns 1
+// if it answered OK or ERROR within 'timeout_ms', with the IMEI (if one came
+// back) in 'imei'. Diagnostics and NMEA interfaces stay silent. Any other
+// lines (boot URCs racing the answer) are kept in 'urcs' for the caller.
+int port_identify(HANDLE h, char* imei, int size, char* urcs, int urcs_size, DWORD timeout_ms) {
+    static const char cmd[] = "AT+CGSN\r\n";
+    char buf[256];
+    int len = 0;
+    int answered = 0;
+    DWORD n = 0;
+    OVERLAPPED ov;
+    ULONGLONG until = mono_now_ms() + timeout_ms;
+
+    imei[0] = '\0';
+    urcs[0] = '\0';
+    memset(&ov, 0, sizeof(ov));
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!ov.hEvent) return 0;
+    if (!WriteFile(h, cmd, sizeof(cmd) - 1, &n, &ov) &&
+        (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(h, &ov, &n, TRUE))) {
+        CloseHandle(ov.hEvent);
+        return 0;
+    }
+    while (!answered && mono_now_ms() < until) {
+        DWORD wait_ms = (DWORD)(until - mono_now_ms());
+        ResetEvent(ov.hEvent);
+        n = 0;
+        if (!ReadFile(h, buf + len, (DWORD)(sizeof(buf) - 1 - len), &n, &ov)) {
+            if (GetLastError() != ERROR_IO_PENDING) break;
+            if (WaitForSingleObject(ov.hEvent, wait_ms) != WAIT_OBJECT_0) try_cancel_overlapped(h, &ov);
+            if (!GetOverlappedResult(h, &ov, &n, TRUE)) n = 0;
+        }
+        len += (int)n;
+        buf[len] = '\0';
+        // Consume complete lines
+        char* eol;
+        while (!answered && (eol = strchr(buf, '\n')) != NULL) {
+            *eol = '\0';
+            buf[strcspn(buf, "\r")] = '\0';
+            if (buf[0] && strspn(buf, "0123456789") == strlen(buf)) snprintf(imei, size, "%s", buf);
+            else if (strcmp(buf, "OK") == 0 || strstr(buf, "ERROR")) answered = 1;
+            else if (buf[0] && strcmp(buf, "AT+CGSN") != 0) {
+                int used = (int)strlen(urcs);
+                snprintf(urcs + used, urcs_size - used, "\r\n%s\r\n", buf);
+            }
+            len -= (int)(eol + 1 - buf);
+            memmove(buf, eol + 1, len + 1);
+        }
+        if (len >= (int)sizeof(buf) - 1) len = 0;   // no line end in sight: not a modem
+    }
+    CloseHandle(ov.hEvent);
+    return answered;
+}
+
+// The port went away under the receive thread. Drop the dead handle and
+// reopen as soon as the device is back, under its old name or as a COM port
+// that did not exist when it vanished (re-enumeration can renumber it).
+// A renumbered module brings back several interfaces, so a new port is only
+// adopted if it answers AT+CGSN, with the session's IMEI once that is known;
+// a silent one is probed again later (the module may still be booting),
+// another module's is never tried again.
+// The ring buffer and its readers are untouched, so URC monitoring simply
+// continues on the new handle. Writers fail fast while hCom is invalid.
+// Returns 1 once reopened, 0 if the session was stopped first.
+int serial_reattach(SerialPort* serial) {
+    char before[SERIAL_MAX_PORTS][16];
+    char now[SERIAL_MAX_PORTS][16];
+    int local = !net_port_kind(serial->port_name);
+    int nbefore = 0;
+    HANDLE arrival = CreateEvent(NULL, FALSE, FALSE, NULL);
+    HCMNOTIFICATION notify = NULL;
+    LONGLONG lost_us = mono_now_us();
+    HANDLE dead = serial->hCom;
+    ULONGLONG next_probe = 0;
+
+    serial->hCom = INVALID_HANDLE_VALUE;
+    close_serial_port(dead);
+    if (local) {
+        nbefore = serial_port_names(before, SERIAL_MAX_PORTS);
+        if (arrival) notify = port_arrival_watch(arrival);
+    }
+    log_printf(LOG_PROGRESS, "\nPort %s went away; reopening when it returns...\n", serial->port_name);
+
+    while (serial->running) {
+        HANDLE h = open_serial_port(serial->port_name, serial->baud);
+        if (h == INVALID_HANDLE_VALUE && local && mono_now_ms() >= next_probe) {
+            int n = serial_port_names(now, SERIAL_MAX_PORTS);
+            int silent = 0;
+            for (int i = 0; i < n && h == INVALID_HANDLE_VALUE; ++i) {
+                char imei[32];
+                char urcs[256];
+                int known = 0;
+                for (int j = 0; j < nbefore && !known; ++j) known = _stricmp(now[i], before[j]) == 0;
+                if (known || port_held(now[i])) continue;   // another session's
+                h = open_serial_port(now[i], serial->baud);
+                if (h == INVALID_HANDLE_VALUE) continue;
+                if (!port_identify(h, imei, sizeof(imei), urcs, sizeof(urcs), PORT_IDENTIFY_MS)) {
+                    silent = 1;
+                }
+                else if (serial->imei[0] && strcmp(imei, serial->imei) != 0) {
+                    log_printf(LOG_PROGRESS, "%s belongs to module %s; still waiting for %s\n", now[i],
+                        imei[0] ? imei : "(unknown)", serial->imei);
+                    if (nbefore < SERIAL_MAX_PORTS) snprintf(before[nbefore++], sizeof(before[0]), "%s", now[i]);
+                }
+                else {
+                    log_printf(LOG_PROGRESS, "Module re-enumerated as %s\n", now[i]);
+                    port_hold(serial->port_name, 0);
+                    port_hold(now[i], 1);
+                    snprintf(serial->port_name, sizeof(serial->port_name), "%s", now[i]);
+                    // Boot URCs (+CFOTA, QCRDY) that arrived ahead of the answer
+                    ring_buffer_put_bulk(serial->rxBuffer, urcs, (int)strlen(urcs));
+                    continue;
+                }
+                close_serial_port(h);
+                h = INVALID_HANDLE_VALUE;
+            }
+            if (silent) next_probe = mono_now_ms() + RECONNECT_PROBE_MS;
+        }
+        if (h != INVALID_HANDLE_VALUE) {
+            LONGLONG away_us = mono_now_us() - lost_us;
+            serial->hCom = h;
+            InterlockedIncrement(&serial->reconnects);
+            metrics_add(MET_RECONNECTS, 1);
+            metrics_add(MET_OFFLINE_US, away_us);
+            trace_span("rx", "port away", lost_us, -1, serial->port_name);
+            log_printf(LOG_PROGRESS, "Reopened %s after %.0f ms\n", serial->port_name, away_us / 1000.0);
+            break;
+        }
+        // Woken at once by an arrival notification, else poll
+        if (arrival) WaitForSingleObject(arrival, RECONNECT_POLL_MS);
+        else Sleep(RECONNECT_POLL_MS);
+    }
+    port_arrival_unwatch(notify);
+    if (arrival) CloseHandle(arrival);
+    return serial->hCom != INVALID_HANDLE_VALUE;
+}
+
+// Serial receive thread (uses OVERLAPPED asynchronous reads to reduce blocking)
+DWORD WINAPI serial_receive_thread(LPVOID param) {
+    SerialPort* serial = (SerialPort*)param;
+    DWORD bytesRead = 0;
+    RingBuffer* rb = serial->rxBuffer;
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    trace_thread_name("serial rx");
+    metrics_attach_thread(serial->metrics);
+    g_profile = serial->profile;    // reopening the port needs the same settings
+    ULONGLONG last_error_check = mono_now_ms();
+    LONGLONG stall_start = 0;
+    NetLink* net = net_link(serial->hCom);
+
+    while (serial->running) {
+        // Read straight into the ring's free space (no intermediate copy)
+        char* span;
+        int space = ring_buffer_write_span(rb, &span);
+        if (space <= 0) {
+            // buffer full, wait for consumer
+            if (!stall_start) {
+                stall_start = mono_now_us();
+                metrics_add(MET_RING_STALLS, 1);
+                PROBE_RING_FULL(RING_BUFFER_SIZE);
+                alog_event(EV_RING_FULL, RING_BUFFER_SIZE, 0, NULL, 0);
+            }
+            poll_sleep(1);
+            continue;
+        }
+        if (stall_start) {
+            metrics_add(MET_RING_STALL_US, mono_now_us() - stall_start);
+            trace_span("rx", "ring full", stall_start, -1, NULL);
+            stall_start = 0;
+        }
+        if (space > RX_READ_MAX) space = RX_READ_MAX;
+
+        ResetEvent(ov.hEvent);
+        HANDLE hCom = serial->hCom;
+        DWORD err = 0;
+        BOOL ok = ReadFile(hCom, span, (DWORD)space, &bytesRead, &ov);
+        if (!ok) {
+            err = GetLastError();
+            if (err == ERROR_IO_PENDING) {
+                DWORD wait = WaitForSingleObject(ov.hEvent, 500);
+                if (wait != WAIT_OBJECT_0) {
+                    // timeout: cancel so the read cannot land in the span later,
+                    // but keep whatever already arrived
+                    try_cancel_overlapped(hCom, &ov);
+                }
+                // Reports the bytes transferred even when the read was cancelled
+                err = GetOverlappedResult(hCom, &ov, &bytesRead, TRUE) ? 0 : GetLastError();
+                ok = err == 0 && wait == WAIT_OBJECT_0;
+            }
+            else {
+                bytesRead = 0;
+            }
+        }
+
+        // A vanished USB port fails every read; a closed network link
+        // completes one with no data
+        if (serial_port_gone(err) || (net && ok && bytesRead == 0)) {
+            if (!serial_reattach(serial)) break;
+            net = net_link(serial->hCom);
+            continue;
+        }
+        if (err != 0 && err != ERROR_OPERATION_ABORTED) {
+            Sleep(1); // other immediate error
+        }
+
+        // Poll the driver's error flags periodically (framing/parity/overrun)
+        if (!net && mono_now_ms() - last_error_check >= 100) {
+            DWORD errors = 0;
+            COMSTAT comStat;
+            last_error_check = mono_now_ms();
+            if (ClearCommError(serial->hCom, &errors, &comStat) &&
+                (errors & (CE_FRAME | CE_RXPARITY | CE_OVERRUN | CE_RXOVER))) {
+                metrics_add(MET_LINE_ERRORS, 1);
+                if (errors & (CE_OVERRUN | CE_RXOVER)) metrics_add(MET_OVERRUNS, 1);
+            }
+        }
+
+        if (bytesRead > 0) {
+            metrics_add(MET_RX_BYTES, bytesRead);
+            if (net && net->kind == NET_RFC2217) bytesRead = (DWORD)net_rx_filter(net, span, (int)bytesRead);
+            ring_buffer_commit(rb, (int)bytesRead);
+        }
+    }
+
+    CloseHandle(ov.hEvent);
+    return 0;
+}
+
+// FTDI bridges hold received bytes for LatencyTimer ms (16 by default)
+// before sending a short USB packet, which adds that much to every reply.
+// The value lives in the device's FTDIBUS registry key; find the key whose
+// PortName matches and lower it to 'want_ms'. Writing needs administrator
+// rights, and the driver only reads the value when the device starts, so it
+// takes effect once the device is replugged. Returns 1 if the port is an
+// FTDI device, with its value in 'current_ms' ('previous_ms' before a write).
+int ftdi_latency_timer(const char* portName, DWORD want_ms, DWORD* current_ms, DWORD* previous_ms) {
+    const char* root_path = "SYSTEM\\CurrentControlSet\\Enum\\FTDIBUS";
+    HKEY root;
+    int found = 0;
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, root_path, 0, KEY_ENUMERATE_SUB_KEYS, &root) != ERROR_SUCCESS) return 0;
+    for (DWORD i = 0; !found; ++i) {
+        char device[256];
+        char params_path[512];
+        char port[32];
+        DWORD device_len = sizeof(device);
+        DWORD port_len = sizeof(port);
+        DWORD type = 0;
+        DWORD latency = 0;
+        DWORD latency_len = sizeof(latency);
+        HKEY params;
+        if (RegEnumKeyExA(root, i, device, &device_len, NULL, NULL, NULL, NULL) != ERROR_SUCCESS) break;
+        snprintf(params_path, sizeof(params_path), "%s\\%s\\0000\\Device Parameters", root_path, device);
+        if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, params_path, 0, KEY_QUERY_VALUE, &params) != ERROR_SUCCESS) continue;
+        if (RegQueryValueExA(params, "PortName", NULL, &type, (BYTE*)port, &port_len) == ERROR_SUCCESS &&
+            type == REG_SZ && _stricmp(port, portName) == 0 &&
+            RegQueryValueExA(params, "LatencyTimer", NULL, &type, (BYTE*)&latency, &latency_len) == ERROR_SUCCESS &&
+            type == REG_DWORD) {
+            found = 1;
+            *current_ms = latency;
+            *previous_ms = latency;
+        }
+        RegCloseKey(params);
+        if (found && latency > want_ms &&
+            RegOpenKeyExA(HKEY_LOCAL_MACHINE, params_path, 0, KEY_SET_VALUE, &params) == ERROR_SUCCESS) {
+            if (RegSetValueExA(params, "LatencyTimer", 0, REG_DWORD, (const BYTE*)&want_ms, sizeof(want_ms)) == ERROR_SUCCESS) {
+                *current_ms = want_ms;
+            }
+            RegCloseKey(params);
+        }
+    }
+    RegCloseKey(root);
+    return found;
+}
+
+// Ports whose FTDI latency timer has been looked at. Returns 1 the first
+// time it is called for 'portName' (sessions on other threads open ports too).
+static int ftdi_first_check(const char* portName) {
+    static SRWLOCK lock = SRWLOCK_INIT;
+    static char checked[SERIAL_MAX_PORTS][16];
+    static int count = 0;
+    int first = 1;
+    AcquireSRWLockExclusive(&lock);
+    for (int i = 0; i < count && first; ++i) first = _stricmp(checked[i], portName) != 0;
+    if (first && count < SERIAL_MAX_PORTS) snprintf(checked[count++], sizeof(checked[0]), "%s", portName);
+    ReleaseSRWLockExclusive(&lock);
+    return first;
+}
+
+// Serial port functions
+HANDLE open_serial_port(const char* portName, int baudRate) {
+    HANDLE hCom;
+    char fullPortName[20];
+    DCB dcb;
+    COMMTIMEOUTS timeouts;
+
+    int net_kind = net_port_kind(portName);
+    if (net_kind) return net_open(portName, net_kind, baudRate);
+
+    sprintf_s(fullPortName, sizeof(fullPortName), "\\\\.\\%s", portName);
+
+    if (g_profile.low_latency && ftdi_first_check(portName)) {
+        DWORD latency = 0;
+        DWORD previous = 0;
+        if (ftdi_latency_timer(portName, FTDI_LOW_LATENCY_MS, &latency, &previous) && latency > FTDI_LOW_LATENCY_MS) {
+            log_printf(LOG_PROGRESS, "FTDI latency timer on %s is %lu ms; run as administrator to lower it to %d ms\n",
+                portName, (unsigned long)latency, FTDI_LOW_LATENCY_MS);
+        }
+        else if (previous != latency) {
+            log_printf(LOG_PROGRESS, "FTDI latency timer on %s lowered from %lu to %lu ms; "
+                "unplug and replug the device for it to take effect\n",
+                portName, (unsigned long)previous, (unsigned long)latency);
+        }
+    }
+
+    // Open overlapped so we can do async I/O
+    hCom = CreateFileA(fullPortName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+
+    if (hCom == INVALID_HANDLE_VALUE) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Configure serial port parameters
+    memset(&dcb, 0, sizeof(dcb));
+    dcb.DCBlength = sizeof(dcb);
+    if (!GetCommState(hCom, &dcb)) {
+        CloseHandle(hCom);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    dcb.BaudRate = baudRate;
+    dcb.ByteSize = 8;
+    dcb.Parity = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    dcb.fDtrControl = DTR_CONTROL_ENABLE;
+    dcb.fRtsControl = g_profile.rtscts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+    dcb.fOutxCtsFlow = g_profile.rtscts ? 1 : 0;
+
+    if (!SetCommState(hCom, &dcb)) {
+        CloseHandle(hCom);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Configure timeouts
+    memset(&timeouts, 0, sizeof(timeouts));
+    if (g_profile.low_latency) {
+        // MAXDWORD interval and multiplier: a read completes as soon as any
+        // byte is available, or after the constant when the line is idle
+        timeouts.ReadIntervalTimeout = MAXDWORD;
+        timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+        timeouts.ReadTotalTimeoutConstant = LOW_LATENCY_READ_WAIT_MS;
+    }
+    else {
+        timeouts.ReadIntervalTimeout = 50;
+        timeouts.ReadTotalTimeoutConstant = 50;
+        timeouts.ReadTotalTimeoutMultiplier = 10;
+    }
+    timeouts.WriteTotalTimeoutConstant = 10;
+    timeouts.WriteTotalTimeoutMultiplier = 10;
+
+    if (!SetCommTimeouts(hCom, &timeouts)) {
+        CloseHandle(hCom);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return hCom;
+}
+
+// AT commands are assembled as fragments: a literal prefix, validated
+// arguments and the trailing "\r\n". Serial handles cannot use
+// WriteFileGather (it needs unbuffered, page-aligned file I/O), so at_send
+// coalesces the fragments once into a stack or session block and issues a
+// single write. Nothing is printf-formatted and no length is capped.
+typedef struct {
+    const char* data;
+    size_t len;
+} AtFrag;
+
+typedef struct {
+    AtFrag frags[AT_MAX_FRAGS];
+    int count;
+    int ok;                         // cleared when an argument is rejected
+    char digits[AT_MAX_FRAGS][24];  // storage for integer arguments
+    int ndigits;
+} AtCommand;
+
+// Literal prefixes are checked at compile time: AT_BEGIN(&c, "ATI") builds,
+// AT_BEGIN(&c, "HTTPINIT") does not.
+constexpr int at_literal_ok(const char* s) {
+    return s[0] == 'A' && s[1] == 'T';
+}
+#define AT_BEGIN(c, lit) ((void)sizeof(char[at_literal_ok(lit) ? 1 : -1]), at_begin((c), (lit), sizeof(lit) - 1))
+#define AT_LIT(c, lit) at_append((c), (lit), sizeof(lit) - 1)
+
+void at_append(AtCommand* c, const char* data, size_t len) {
+    if (c->count >= AT_MAX_FRAGS) {
+        c->ok = 0;
+        return;
+    }
+    c->frags[c->count].data = data;
+    c->frags[c->count].len = len;
+    c->count++;
+}
+
+void at_begin(AtCommand* c, const char* prefix, size_t len) {
+    c->count = 0;
+    c->ok = 1;
+    c->ndigits = 0;
+    at_append(c, prefix, len);
+}
+
+// Argument placed between quotes. The AT parser has no escape for '"' or
+// line breaks, so such arguments are rejected rather than sent mangled.
+void at_quoted(AtCommand* c, const char* arg) {
+    size_t len = strlen(arg);
+    // 0xFF is never valid UTF-8 and an RFC 2217 link would read it as a Telnet command
+    if (strcspn(arg, "\"\r\n\xff") != len) {
+        printf("Argument contains a quote, line break or 0xFF byte and cannot be sent: %s\n", arg);
+        c->ok = 0;
+        return;
+    }
+    at_append(c, arg, len);
+}
+
+void at_int(AtCommand* c, long long value) {
+    if (c->ndigits >= AT_MAX_FRAGS) {
+        c->ok = 0;
+        return;
+    }
+    char* end = c->digits[c->ndigits] + sizeof(c->digits[0]);
+    char* p = end;
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) *--p = '-';
+    c->ndigits++;
+    at_append(c, p, (size_t)(end - p));
+}
+
+// Write a whole buffer with overlapped I/O. Returns 1 on success.
+static int at_write(HANDLE hCom, const char* buf, DWORD len) {
+    DWORD bytesWritten = 0;
+
+    // Use OVERLAPPED WriteFile to avoid blocking the caller. We open the port with
+    // FILE_FLAG_OVERLAPPED, so this will be asynchronous when needed.
+    OVERLAPPED ov = { 0 };
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    BOOL ok = WriteFile(hCom, buf, len, &bytesWritten, &ov);
+    if (!ok) {
+        DWORD err = GetLastError();
+        if (err == ERROR_IO_PENDING) {
+            // wait for completion with a modest timeout
+            DWORD wait = WaitForSingleObject(ov.hEvent, 2000);
+            if (wait == WAIT_OBJECT_0) {
+                if (!GetOverlappedResult(hCom, &ov, &bytesWritten, FALSE)) {
+                    CloseHandle(ov.hEvent);
+                    return 0;
+                }
+            }
+            else {
+                // timeout or error; cancel pending I/O
+                CancelIo(hCom);
+                CloseHandle(ov.hEvent);
+                return 0;
+            }
+        }
+        else {
+            CloseHandle(ov.hEvent);
+            return 0;
+        }
+    }
+
+    CloseHandle(ov.hEvent);
+    metrics_add(MET_TX_BYTES, bytesWritten);
+    return (bytesWritten == len);
+}
+
+// Bytes on the wire for 'c', including the trailing "\r\n".
+size_t at_length(const AtCommand* c) {
+    size_t len = 2;
+    for (int i = 0; i < c->count; ++i) len += c->frags[i].len;
+    return len;
+}
+
+int at_send(HANDLE hCom, AtCommand* c) {
+    char small[AT_INLINE_BYTES];
+    SessionArena* arena = NULL;
+    char* buf = small;
+    size_t len = at_length(c) - 2;
+    if (!c->ok) return 0;
+
+    if (len + 2 > sizeof(small)) {
+        arena = arena_current();
+        buf = arena_block_get(arena, (int)(len + 2));
+        if (!buf) return 0;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < c->count; ++i) {
+        memcpy(buf + pos, c->frags[i].data, c->frags[i].len);
+        pos += c->frags[i].len;
+    }
+
+    // The command text is NUL-terminated in place for tracing, then the
+    // terminator is replaced by "\r\n"
+    buf[len] = '\0';
+    at_span_begin(buf);
+    PROBE_COMMAND_SENT(buf);
+    alog_event(EV_COMMAND_SENT, 0, 0, buf, (int)len);
+    buf[len] = '\r';
+    buf[len + 1] = '\n';
+
+    int ok = at_write(hCom, buf, (DWORD)(len + 2));
+    if (buf != small) arena_block_put(arena, buf);
+    return ok;
+}
+
+int send_at_command(HANDLE hCom, const char* command) {
+    AtCommand c;
+    at_begin(&c, command, strlen(command));
+    return at_send(hCom, &c);
+}
+
+// Read a line from the ring buffer
+int read_line_from_buffer(RingBuffer* rb, char* buffer, int bufferSize) {
+    // Find newline without removing bytes first
+    int idx = ring_buffer_find_char(rb, '\n');
+    if (idx == -1) return 0; // no complete line yet
+
+    int toCopy = idx + 1; // include the '\n'
+    if (toCopy > bufferSize - 1) toCopy = bufferSize - 1; // avoid overflow
+
+    int n = ring_buffer_read_bulk(rb, buffer, toCopy);
+    if (n <= 0) return 0;
+    buffer[n] = '\0';
+    PROBE_LINE_RECEIVED(buffer, n);
+    return 1;
+}
+
+
+// Wait for a specific response. If 'capture_prefix' is given, the first line
+// containing it is copied to 'captured' (e.g. the +CGMR: line before OK).
+int wait_for_response_capture(RingBuffer* rb, const char* expected, const char* capture_prefix,
+    char* captured, int captured_size, int timeout_ms) {
+    char line[256];
+    Timer deadline;
+
+    deadline_start(&deadline, (DWORD)timeout_ms);
+    while (!deadline_expired(&deadline)) {
+        if (read_line_from_buffer(rb, line, sizeof(line))) {
+            log_rx_line(line);
+            at_span_line();
+
+            if (capture_prefix && strstr(line, capture_prefix) != NULL) {
+                snprintf(captured, captured_size, "%s", line);
+                capture_prefix = NULL;
+            }
+            if (strstr(line, expected) != NULL) {
+                deadline_cancel(&deadline);
+                at_span_end(expected);
+                return 1;
+            }
+            continue;
+        }
+        ring_buffer_wait(rb, &deadline, 0);
+    }
+    at_span_end("timeout");
+    return 0;
+}
+
+// Wait for a specific response
+int wait_for_response(RingBuffer* rb, const char* expected, int timeout_ms) {
+    return wait_for_response_capture(rb, expected, NULL, NULL, 0, timeout_ms);
+}
+
+// Parse numeric response
+int parse_number_response(RingBuffer* rb, const char* prefix, long long* value, int timeout_ms) {
+    char line[256];
+    Timer deadline;
+
+    deadline_start(&deadline, (DWORD)timeout_ms);
+    while (!deadline_expired(&deadline)) {
+        if (read_line_from_buffer(rb, line, sizeof(line))) {
+            log_rx_line(line);
+            at_span_line();
+
+            const char* pos = strstr(line, prefix);
+            if (pos != NULL) {
+                pos += strlen(prefix);
+                while (*pos && !isdigit(*pos)) pos++;
+                if (*pos) {
+                    deadline_cancel(&deadline);
+                    if (!parse_size(pos, value)) {
+                        printf("Value out of range: %s\n", line);
+                        return 0;
+                    }
+                    return 1;
+                }
+            }
+            continue;
+        }
+        ring_buffer_wait(rb, &deadline, 0);
+    }
+    at_span_end("timeout");
+    return 0;
+}
+
+// Enumerate available serial ports
+void enumerate_serial_ports() {
+    printf("Available serial ports:\n");
+
+    for (int i = 1; i <= 20; i++) {
+        char portName[20];
+        HANDLE hCom;
+
+        sprintf_s(portName, sizeof(portName), "COM%d", i);
+        hCom = CreateFileA(portName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+            OPEN_EXISTING, 0, NULL);
+
+        if (hCom != INVALID_HANDLE_VALUE) {
+            printf("  %s\n", portName);
+            CloseHandle(hCom);
+        }
+    }
+}
+
+// Where the wall time of a transfer went. Filled in by the transfer code
+// from timestamps it already takes, then summarised by transfer_report.
+typedef struct {
+    const char* label;          // "download" / "upload"
+    int baud;
+    LONGLONG start_us;
+    LONGLONG end_us;
+    LONGLONG wait_us;           // command sent -> first reply byte (module / network)
+    LONGLONG consumer_us;       // host side: disk I/O and ring-full stalls
+    LONGLONG stall_base_us;     // ring stall counter at transfer start
+    LONG64 heap_base;           // heap allocation counter at transfer start
+    LONG64 heap_allocs;         // heap allocations during the transfer
+    LONG64 overrun_base;
+    LONG64 overruns;            // driver-reported receive overruns during the transfer
+    long long payload_bytes;
+    long long wire_bytes;       // payload plus command/response framing on the UART
+    int commands;
+} TransferStats;
+
+void transfer_stats_begin(TransferStats* st, const char* label, int baud) {
+    DeviceMetrics* dev = metrics_current_device();
+    memset(st, 0, sizeof(*st));
+    st->label = label;
+    st->baud = baud;
+    st->start_us = mono_now_us();
+    st->stall_base_us = dev ? metrics_get(dev, MET_RING_STALL_US) : 0;
+    st->heap_base = dev ? metrics_get(dev, MET_HEAP_ALLOCS) : 0;
+    st->overrun_base = dev ? metrics_get(dev, MET_OVERRUNS) : 0;
+}
+
+void transfer_stats_end(TransferStats* st) {
+    DeviceMetrics* dev = metrics_current_device();
+    st->end_us = mono_now_us();
+    if (dev) st->consumer_us += metrics_get(dev, MET_RING_STALL_US) - st->stall_base_us;
+    if (dev) st->heap_allocs = metrics_get(dev, MET_HEAP_ALLOCS) - st->heap_base;
+    if (dev) st->overruns = metrics_get(dev, MET_OVERRUNS) - st->overrun_base;
+}
+
+// Print the time split and a verdict on what limited the transfer.
+void transfer_report(const TransferStats* st) {
+    double wall = (double)(st->end_us - st->start_us) / 1000000.0;
+    if (wall <= 0.0 || st->baud <= 0) return;
+    // 8-N-1 framing: 10 bit times per byte on the wire
+    double uart = (double)st->wire_bytes * 10.0 / (double)st->baud;
+    double wait = (double)st->wait_us / 1000000.0;
+    double consumer = (double)st->consumer_us / 1000000.0;
+    if (uart > wall) uart = wall;
+    if (wait > wall - uart) wait = wall - uart;
+    if (consumer > wall - uart - wait) consumer = wall - uart - wait;
+    double overhead = wall - uart - wait - consumer;
+
+    log_printf(LOG_PROGRESS, "\nTransfer analysis (%s): %lld bytes in %.2f s, %.1f KB/s\n",
+        st->label, st->payload_bytes, wall, (double)st->payload_bytes / 1024.0 / wall);
+    log_printf(LOG_PROGRESS, "  module/network wait  %8.2f s (%5.1f%%)\n", wait, wait / wall * 100.0);
+    log_printf(LOG_PROGRESS, "  UART at %-7d baud  %8.2f s (%5.1f%%)\n", st->baud, uart, uart / wall * 100.0);
+    log_printf(LOG_PROGRESS, "  host consumer        %8.2f s (%5.1f%%)\n", consumer, consumer / wall * 100.0);
+    log_printf(LOG_PROGRESS, "  protocol overhead    %8.2f s (%5.1f%%)\n", overhead, overhead / wall * 100.0);
+    log_printf(LOG_PROGRESS, "  heap allocations     %8lld\n", (long long)st->heap_allocs);
+    if (st->overruns > 0) {
+        log_printf(LOG_PROGRESS, "  receive overruns     %8lld  (data lost; see --rx-priority / --rx-cpu)\n",
+            (long long)st->overruns);
+    }
+
+    if (uart >= wait && uart >= consumer && uart >= overhead) {
+        log_printf(LOG_PROGRESS, "  Verdict: serial-bound at %.0f%% of %d\n", uart / wall * 100.0, st->baud);
+        log_printf(LOG_PROGRESS, "  Suggestion: raise the baud rate (e.g. 921600 or higher) with RTS/CTS flow control\n");
+    }
+    else if (wait >= consumer && wait >= overhead) {
+        log_printf(LOG_PROGRESS, "  Verdict: network-bound (module waited %.0f%% of the time)\n", wait / wall * 100.0);
+        log_printf(LOG_PROGRESS, "  Suggestion: check signal quality and APN; a faster baud rate will not help\n");
+    }
+    else if (consumer >= overhead) {
+        log_printf(LOG_PROGRESS, "  Verdict: host-bound (disk writes and ring-full stalls)\n");
+        log_printf(LOG_PROGRESS, "  Suggestion: write to a faster local disk and reduce console output\n");
+    }
+    else {
+        log_printf(LOG_PROGRESS, "  Verdict: protocol-overhead-bound (%d commands)\n", st->commands);
+        log_printf(LOG_PROGRESS, "  Suggestion: request larger HTTPREAD chunks to amortise per-command round trips\n");
+    }
+}
+
+// Policies for the HTTPREAD engine. The engine is a template over them so
+// each combination compiles to its own loop with the policy calls inlined:
+//   Transport  send(AtCommand*) puts a command on the wire;
+//              wait(rb, ms) blocks up to 'ms' until more bytes may be in 'rb'.
+//   Clock      now_us() timestamps used for the transfer statistics and the
+//              stall deadline (expired / remaining_ms against a start time).
+//   Sink       where payload goes (see FileSink / DiscardSink).
+struct SerialTransport {
+    HANDLE hCom;
+    int send(AtCommand* c) { return at_send(hCom, c); }
+    void wait(RingBuffer* rb, DWORD ms) { ring_buffer_wait(rb, NULL, ms); }
+};
+
+// Milliseconds left of 'ms' since 'start_us', given the time now.
+static DWORD clock_remaining_ms(LONGLONG now_us, LONGLONG start_us, DWORD ms) {
+    LONGLONG left = (LONGLONG)ms * 1000 - (now_us - start_us);
+    return left > 0 ? (DWORD)((left + 999) / 1000) : 0;
+}
+
+struct MonoClock {
+    LONGLONG now_us() { return mono_now_us(); }
+    int expired(LONGLONG start_us, DWORD ms) { return remaining_ms(start_us, ms) == 0; }
+    DWORD remaining_ms(LONGLONG start_us, DWORD ms) { return clock_remaining_ms(now_us(), start_us, ms); }
+};
+
+// Virtual time, advanced explicitly by a simulated transport.
+struct SimClock {
+    LONGLONG t;
+    LONGLONG now_us() { return t; }
+    int expired(LONGLONG start_us, DWORD ms) { return remaining_ms(start_us, ms) == 0; }
+    DWORD remaining_ms(LONGLONG start_us, DWORD ms) { return clock_remaining_ms(t, start_us, ms); }
+};
+
+// Simulated module: answers AT+HTTPREAD from a synthetic body of
+// 'body_left' bytes and feeds the response into the ring as a UART at
+// 'baud' would, advancing 'clock' by the command latency and the 10 bit
+// times per byte. No serial port or receive thread is involved.
+struct SimTransport {
+    SimClock* clock;
+    int baud;
+    LONGLONG latency_us;
+    int read_size;
+    long long body_left;
+    char header[48];
+    int header_len;
+    int header_pos;
+    int payload_left;
+    int trailer_pos;
+
+    int send(AtCommand* c) {
+        int n = body_left < read_size ? (int)body_left : read_size;
+        (void)c;
+        body_left -= n;
+        header_len = snprintf(header, sizeof(header), "\r\nOK\r\n\r\n+HTTPREAD: %d\r\n", n);
+        header_pos = 0;
+        payload_left = n;
+        trailer_pos = 0;
+        clock->t += latency_us;
+        return 1;
+    }
+
+    void wait(RingBuffer* rb, DWORD ms) {
+        static const char trailer[] = "\r\n+HTTPREAD: 0\r\n";
+        static char pattern[256];
+        static int pattern_ready;
+        int pushed = 0;
+        if (!pattern_ready) {
+            for (int k = 0; k < 256; ++k) pattern[k] = (char)(k ^ 0x5A);
+            pattern_ready = 1;
+        }
+        if (header_pos < header_len) {
+            int w = ring_buffer_put_bulk(rb, header + header_pos, header_len - header_pos);
+            if (w > 0) { header_pos += w; pushed += w; }
+        }
+        while (header_pos == header_len && payload_left > 0) {
+            int n = payload_left < (int)sizeof(pattern) ? payload_left : (int)sizeof(pattern);
+            int w = ring_buffer_put_bulk(rb, pattern, n);
+            if (w <= 0) break;
+            payload_left -= w;
+            pushed += w;
+        }
+        if (header_pos == header_len && payload_left == 0 && trailer_pos < (int)sizeof(trailer) - 1) {
+            int w = ring_buffer_put_bulk(rb, trailer + trailer_pos, (int)sizeof(trailer) - 1 - trailer_pos);
+            if (w > 0) { trailer_pos += w; pushed += w; }
+        }
+        clock->t += (LONGLONG)pushed * 10 * 1000000 / baud;
+        if (!pushed) clock->t += (LONGLONG)ms * 1000;  // a silent line: the wait runs out
+    }
+};
+
+// Payload is copied into a session block, hex-dumped at LOG_HEXDUMP and
+// written to 'file'; response lines are logged. A short write (disk full)
+// sets 'write_failed' and nothing after it is checkpointed.
+struct FileSink {
+    FILE* file;
+    SessionArena* arena;
+    int write_failed;
+    enum { kLogLines = 1, kNeedsBuffer = 1 };
+    const char* label() { return "download"; }
+    char* begin(int len) { return arena_block_get(arena, len); }
+    int take(RingBuffer* rb, char* data, int got, int len) { return ring_buffer_read_bulk(rb, data + got, len - got); }
+    void abort(char* data) { arena_block_put(arena, data); }
+    // Returns the time spent on the host side (disk)
+    LONGLONG end(char* data, int len, long long offset) {
+        if (g_log_level >= LOG_HEXDUMP) {
+            // 16-byte-per-line hex view with offset relative to bytes already received
+            hexdump_chunk((const unsigned char*)data, len, offset);
+        }
+        LONGLONG write_start = mono_now_us();
+        if (fwrite(data, 1, len, file) != (size_t)len || fflush(file) != 0) write_failed = 1;
+        else job_checkpoint(offset + len, file);
+        trace_span("disk", "write", write_start, len, NULL);
+        arena_block_put(arena, data);
+        return mono_now_us() - write_start;
+    }
+    int failed() { return write_failed; }
+};
+
+// Payload is dropped straight from the ring without copying it out, and
+// nothing is printed per line (speed test mode).
+struct DiscardSink {
+    enum { kLogLines = 0, kNeedsBuffer = 0 };
+    const char* label() { return "speedtest"; }
+    char* begin(int len) { (void)len; return NULL; }
+    int take(RingBuffer* rb, char* data, int got, int len) { (void)data; return ring_buffer_discard(rb, len - got); }
+    void abort(char* data) { (void)data; }
+    LONGLONG end(char* data, int len, long long offset) { (void)data; (void)len; (void)offset; return 0; }
+    int failed() { return 0; }
+};
+
+// Run the AT+HTTPREAD loop until 'total_size' body bytes have been read.
+// With 'total_size' < 0 the length is unknown: keep reading until a round
+// returns no data, which is how the module reports the end of the body.
+template <class Transport, class Clock, class Sink>
+int http_read_body_t(Transport& io, Clock& clock, Sink& sink, RingBuffer* rb, long long total_size, int read_size,
+    TransferStats* stats) {
+    long long offset = 0;
+    char line[256];
+    long long bytes_received = 0;
+    Progress progress;
+    LONGLONG stall_us;  // clock time the module last made progress
+    AtCommand command;
+
+    AT_BEGIN(&command, "AT+HTTPREAD=0,");
+    at_int(&command, read_size);
+    progress_begin(&progress, sink.label(), "B", total_size > 0 ? total_size : 0);
+    stall_us = clock.now_us();
+    while (total_size < 0 || offset < total_size) {
+        // Send download command
+        if (!io.send(&command)) {
+            printf("Failed to send command\n");
+            progress_end(&progress);
+            return 0;
+        }
+
+        int data_received = 0;
+        int expecting_data = 1;
+        int awaiting_first_line = 1;
+        LONGLONG chunk_start = mono_now_us();
+        LONGLONG sent_us = clock.now_us();
+        stats->commands++;
+        stats->wire_bytes += (long long)at_length(&command);
+
+        while (expecting_data) {
+            if (!read_line_from_buffer(rb, line, sizeof(line))) {
+                if (clock.expired(stall_us, HTTPREAD_STALL_TIMEOUT_MS)) goto stalled;
+                io.wait(rb, clock.remaining_ms(stall_us, HTTPREAD_STALL_TIMEOUT_MS));
+                continue;
+            }
+            stall_us = clock.now_us();
+
+            if (Sink::kLogLines) log_rx_line(line);
+            at_span_line();
+            if (awaiting_first_line) {
+                stats->wait_us += clock.now_us() - sent_us;
+                awaiting_first_line = 0;
+            }
+            stats->wire_bytes += (long long)strlen(line);
+
+            if (strstr(line, "+HTTPREAD: ") != NULL) {
+                // Parse data length
+                const char* data_pos = strstr(line, "+HTTPREAD: ");
+                if (data_pos) {
+                    data_pos += 11;
+                    long long announced = 0;
+                    // More than we asked for would overrun the chunk buffer
+                    if (parse_size(data_pos, &announced) && announced > read_size) {
+                        at_span_end("overlong");
+                        progress_end(&progress);
+                        printf("Module announced an out-of-range chunk: %s\n", line);
+                        return 0;
+                    }
+                    int data_len = (int)announced;
+
+                    if (data_len > 0) {
+                        // Take the binary data from the ring
+                        char* data = sink.begin(data_len);
+                        if (Sink::kNeedsBuffer && !data) {
+                            at_span_end("no buffer");
+                            progress_end(&progress);
+                            printf("Unable to allocate a %d-byte chunk buffer\n", data_len);
+                            return 0;
+                        }
+                        int got = 0;
+                        LONGLONG payload_start = mono_now_us();
+                        PROBE_CHUNK_START(bytes_received, data_len);
+
+                        while (got < data_len) {
+                            int n = sink.take(rb, data, got, data_len);
+                            if (n > 0) {
+                                got += n;
+                            }
+                            else if (clock.expired(stall_us, HTTPREAD_STALL_TIMEOUT_MS)) {
+                                sink.abort(data);
+                                goto stalled;
+                            }
+                            else {
+                                io.wait(rb, clock.remaining_ms(stall_us, HTTPREAD_STALL_TIMEOUT_MS));
+                            }
+                        }
+                        stall_us = clock.now_us();
+                        trace_span("download", "payload", payload_start, data_len, NULL);
+                        PROBE_CHUNK_END(bytes_received, data_len);
+                        alog_event(EV_CHUNK, bytes_received, data_len, NULL, 0);
+
+                        stats->consumer_us += sink.end(data, data_len, bytes_received);
+                        if (sink.failed()) {
+                            at_span_end("write failed");
+                            progress_end(&progress);
+                            printf("Writing the download failed at %lld bytes (disk full?)\n", bytes_received);
+                            return 0;
+                        }
+                        stats->payload_bytes += data_len;
+                        stats->wire_bytes += data_len;
+                        data_received += data_len;
+                        bytes_received += data_len;
+                        metrics_add(MET_CHUNKS, 1);
+                        progress_update(&progress, bytes_received);
+                    }
+                    else {
+                        // No data length, end of data
+                        at_span_end("+HTTPREAD: 0");
+                        trace_span("download", "HTTPREAD chunk", chunk_start, data_received, NULL);
+                        expecting_data = 0;
+                        offset += data_received;
+                        break;
+                    }
+                }
+            }
+            else if (strstr(line, "ERROR") != NULL) {
+                at_span_end("ERROR");
+                progress_end(&progress);
+                printf("Download error\n");
+                return 0;
+            }
+        }
+        if (data_received == 0) {
+            if (total_size < 0) break; // end of a streamed body
+            progress_end(&progress);
+            printf("Module has no more data at %lld of %lld bytes\n", bytes_received, total_size);
+            return 0;
+        }
+    }
+
+    progress_end(&progress);
+    return 1;
+
+stalled:
+    at_span_end("stalled");
+    progress_end(&progress);
+    if (total_size < 0) {
+        printf("Download stalled: no data from module for %d ms (%lld bytes received)\n",
+            HTTPREAD_STALL_TIMEOUT_MS, bytes_received);
+        return 0;
+    }
+    printf("Download stalled: no data from module for %d ms (%lld of %lld bytes received)\n",
+        HTTPREAD_STALL_TIMEOUT_MS, bytes_received, total_size);
+    return 0;
+}
+
+// Production instantiations: payload goes to 'file'; with file == NULL it
+// is dropped straight from the ring buffer (speed test mode).
+int http_read_body(HANDLE hCom, RingBuffer* rb, FILE* file, long long total_size, TransferStats* stats) {
+    SerialTransport io = { hCom };
+    MonoClock clock;
+    if (file) {
+        FileSink sink = { file, arena_current(), 0 };
+        return http_read_body_t(io, clock, sink, rb, total_size, g_profile.read_size, stats);
+    }
+    DiscardSink sink;
+    return http_read_body_t(io, clock, sink, rb, total_size, g_profile.read_size, stats);
+}
+
+// Run the engine against SimTransport: 'total_size' bytes at 'baud' with
+// 'latency_ms' per command and 'read_size' per HTTPREAD, timed in virtual
+// time. Fills 'stats' like a real transfer so transfer_report applies.
+int simulate_read_body(long long total_size, int baud, int latency_ms, int read_size, TransferStats* stats) {
+    RingBuffer rb;
+    SimClock clock = { 0 };
+    SimTransport io;
+    DiscardSink sink;
+
+    memset(&io, 0, sizeof(io));
+    io.clock = &clock;
+    io.baud = baud;
+    io.latency_us = (LONGLONG)latency_ms * 1000;
+    io.read_size = read_size;
+    io.body_left = total_size;
+    ring_buffer_init(&rb);
+    transfer_stats_begin(stats, "simulated", baud);
+    stats->start_us = clock.now_us();
+    int ok = http_read_body_t(io, clock, sink, &rb, total_size, read_size, stats);
+    transfer_stats_end(stats);
+    stats->end_us = clock.now_us();
+    ring_buffer_destroy(&rb);
+    return ok;
+}
+
+// Download file data. With 'offset' > 0 the file keeps its first 'offset'
+// bytes (from an interrupted run) and the body is appended after them.
+int download_file_data(HANDLE hCom, RingBuffer* rb, const char* filename, long long offset, long long total_size,
+    TransferStats* stats) {
+    FILE* file;
+
+    if (fopen_s(&file, filename, offset > 0 ? "r+b" : "wb") != 0) {
+        printf("Unable to create file %s\n", filename);
+        return 0;
+    }
+    if (offset > 0 && (_chsize_s(_fileno(file), offset) != 0 || _fseeki64(file, offset, SEEK_SET) != 0)) {
+        printf("Unable to resume %s at byte %lld\n", filename, offset);
+        fclose(file);
+        return 0;
+    }
+
+    int ok = http_read_body(hCom, rb, file, total_size, stats);
+    fclose(file);
+    if (ok) log_printf(LOG_PROGRESS, "File download complete, total size: %lld bytes\n", stats->payload_bytes);
+    return ok;
+}
+
+// Read the AT+HTTPHEAD header block up to the final OK. 'length' gets the
+// Content-Length, or -1 when the response has none (chunked transfer
+// encoding, dynamic endpoints). 'validator' gets the ETag, else the
+// Last-Modified date, else "". Returns 1 once OK arrives.
+int read_http_head(RingBuffer* rb, long long* length, char* validator, int validator_size, int timeout_ms) {
+    char line[256];
+    Timer deadline;
+    int have_etag = 0;
+
+    *length = -1;
+    validator[0] = '\0';
+    deadline_start(&deadline, (DWORD)timeout_ms);
+    while (!deadline_expired(&deadline)) {
+        if (read_line_from_buffer(rb, line, sizeof(line))) {
+            log_rx_line(line);
+            at_span_line();
+            if (_strnicmp(line, "Content-Length:", 15) == 0) {
+                const char* pos = line + 15;
+                while (*pos == ' ') pos++;
+                if (!parse_size(pos, length)) {
+                    printf("Content-Length out of range: %s\n", line);
+                    deadline_cancel(&deadline);
+                    return 0;
+                }
+            }
+            else if (_strnicmp(line, "ETag:", 5) == 0 ||
+                     (!have_etag && _strnicmp(line, "Last-Modified:", 14) == 0)) {
+                const char* pos = strchr(line, ':') + 1;
+                while (*pos == ' ') pos++;
+                have_etag = line[0] == 'E' || line[0] == 'e';
+                snprintf(validator, validator_size, "%.*s", (int)strcspn(pos, "\r\n"), pos);
+            }
+            else if (strncmp(line, "OK", 2) == 0 && (line[2] == '\r' || line[2] == '\n')) {
+                deadline_cancel(&deadline);
+                at_span_end("OK");
+                return 1;
+            }
+            else if (strstr(line, "ERROR") != NULL) {
+                deadline_cancel(&deadline);
+                at_span_end("ERROR");
+                return 0;
+            }
+            continue;
+        }
+        ring_buffer_wait(rb, &deadline, 0);
+    }
+    at_span_end("timeout");
+    return 0;
+}
+
+// Wait for the +HTTPACTION: <method>,<status>,<datalen> URC.
+int wait_for_http_action(RingBuffer* rb, int* status, long long* length, int timeout_ms) {
+    char line[256];
+    Timer deadline;
+
+    deadline_start(&deadline, (DWORD)timeout_ms);
+    while (!deadline_expired(&deadline)) {
+        if (read_line_from_buffer(rb, line, sizeof(line))) {
+            at_span_line();
+            const char* pos = strstr(line, "+HTTPACTION: ");
+            int method = 0;
+            int used = 0;
+            if (pos && sscanf_s(pos + 13, "%d,%d,%n", &method, status, &used) == 2 && used > 0 &&
+                parse_size(pos + 13 + used, length)) {
+                deadline_cancel(&deadline);
+                at_span_end(line);
+                return 1;
+            }
+            continue;
+        }
+        ring_buffer_wait(rb, &deadline, 0);
+    }
+    at_span_end("timeout");
+    return 0;
+}
+
+// Open the serial port and start the receive thread. Returns 1 on success.
+int serial_session_start(SerialPort* serial, RingBuffer* rb, const char* portName, int baudRate, HANDLE* hThread) {
+    ring_buffer_init(rb);
+    timeBeginPeriod(1); // 1 ms scheduler granularity for the remaining sleeps
+    snprintf(serial->port_name, sizeof(serial->port_name), "%s", portName);
+    serial->baud = baudRate;
+    serial->reconnects = 0;
+    serial->profile = g_profile;
+    serial->imei[0] = '\0';
+    serial->hCom = open_serial_port(portName, baudRate);
+    serial->rxBuffer = rb;
+    serial->metrics = metrics_current_device();
+    if (serial->hCom == INVALID_HANDLE_VALUE) {
+        printf("Unable to open serial port %s\n", portName);
+        ring_buffer_destroy(rb);
+        timeEndPeriod(1);
+        return 0;
+    }
+    // Everything the transfer loops need is allocated here, up front
+    if (!arena_init(&serial->arena, ARENA_BLOCK_SIZE, ARENA_BLOCKS)) {
+        printf("Unable to allocate session buffers\n");
+        close_serial_port(serial->hCom);
+        ring_buffer_destroy(rb);
+        timeEndPeriod(1);
+        return 0;
+    }
+    t_arena = &serial->arena;
+    thread_wheel();
+    serial->running = 1;
+    *hThread = CreateThread(NULL, 0, serial_receive_thread, serial, 0, NULL);
+    if (*hThread == NULL) {
+        printf("Unable to create receiver thread\n");
+        close_serial_port(serial->hCom);
+        t_arena = NULL;
+        arena_destroy(&serial->arena);
+        ring_buffer_destroy(rb);
+        timeEndPeriod(1);
+        return 0;
+    }
+    thread_place(*hThread, "receive");
+    port_hold(portName, 1);
+    return 1;
+}
+
+void serial_session_stop(SerialPort* serial, RingBuffer* rb, HANDLE hThread) {
+    serial->running = 0;
+    WaitForSingleObject(hThread, 1000);
+    CloseHandle(hThread);
+    close_serial_port(serial->hCom);
+    port_hold(serial->port_name, 0);
+    if (t_arena == &serial->arena) t_arena = NULL;
+    arena_destroy(&serial->arena);
+    ring_buffer_destroy(rb);
+    timeEndPeriod(1);
+}
+
+// Speed test: HTTPACTION then the HTTPREAD loop with payload discarded, no
+// file I/O. Usage: speedtest <COM> <HTTP_URL> [BAUD] [--iterations N]
+// With the port "SIM" the second argument is a body size and the engine
+// runs against the simulated module in virtual time instead.
+int run_speedtest(int argc, char** argv) {
+    SerialPort serial;
+    RingBuffer rxBuffer;
+    HANDLE hThread;
+    const char* portName = NULL;
+    const char* http_url = NULL;
+    int baudRate = 115200;
+    int iterations = 1;
+    int npos = 0;
+    int completed = 0;
+    double fetch[64], rate[64], efficiency[64];   // fetch: HTTPACTION until its URC (module has the body)
+
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--low-latency") == 0) {
+            g_profile.low_latency = 1;
+        }
+        else if (strcmp(argv[i], "--rx-priority") == 0 || strcmp(argv[i], "--rx-cpu") == 0) {
+            if (rx_placement_option(argc, argv, &i) < 0) return 1;
+        }
+        else if (npos == 0) { portName = argv[i]; npos++; }
+        else if (npos == 1) { http_url = argv[i]; npos++; }
+        else if (npos == 2) {
+            int b = atoi(argv[i]);
+            if (b > 0) baudRate = b;
+            npos++;
+        }
+    }
+    if (!portName || !http_url) {
+        printf("Usage: %s speedtest <COM> <HTTP_URL> [BAUD] [--iterations N]\n", argv[0]);
+        printf("       %s speedtest SIM <BYTES> [BAUD] [--iterations N]\n", argv[0]);
+        return 1;
+    }
+    if (iterations < 1) iterations = 1;
+    if (iterations > 64) iterations = 64;
+    int simulated = _stricmp(portName, "SIM") == 0;
+
+    log_printf(LOG_PROGRESS, "=== SIMCOM HTTP Speed Test ===\n\n");
+    metrics_attach_thread(metrics_register_device(portName));
+    if (simulated) {
+        long long length = 0;
+        if (!parse_size(http_url, &length) || length <= 0) {
+            printf("Invalid simulated body size: %s\n", http_url);
+            return 1;
+        }
+        log_printf(LOG_PROGRESS, "Simulated module at %d baud, %d ms per command\n", baudRate, SIM_COMMAND_LATENCY_MS);
+        for (int it = 0; it < iterations; ++it) {
+            TransferStats st;
+            if (!simulate_read_body(length, baudRate, SIM_COMMAND_LATENCY_MS, g_profile.read_size, &st)) break;
+            double secs = (double)(st.end_us - st.start_us) / 1000000.0;
+            if (secs <= 0.0) secs = 1e-6;
+            fetch[completed] = SIM_COMMAND_LATENCY_MS / 1000.0;
+            rate[completed] = (double)st.payload_bytes / secs;
+            efficiency[completed] = rate[completed] * 10.0 / (double)baudRate * 100.0;
+            log_printf(LOG_PROGRESS, "  %lld bytes in %.2f s (virtual), %.1f KB/s, serial efficiency %.1f%%, %lld heap allocations\n",
+                length, secs, rate[completed] / 1024.0, efficiency[completed], (long long)st.heap_allocs);
+            completed++;
+        }
+    }
+    else {
+        log_printf(LOG_PROGRESS, "Opening serial port %s at %d baud...\n", portName, baudRate);
+        if (!serial_session_start(&serial, &rxBuffer, portName, baudRate, &hThread)) {
+            return 1;
+        }
+
+        // Interactive latency: AT -> OK round trips
+        LONGLONG rtt[9];
+        int nrtt = 0;
+        for (int k = 0; k < 9; ++k) {
+            LONGLONG t0 = mono_now_us();
+            if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000)) break;
+            LONGLONG v = mono_now_us() - t0;
+            int pos = nrtt++;
+            while (pos > 0 && rtt[pos - 1] > v) { rtt[pos] = rtt[pos - 1]; pos--; }
+            rtt[pos] = v;
+        }
+        if (nrtt > 0) {
+            log_printf(LOG_PROGRESS, "AT round trip: min %.2f ms, median %.2f ms (%s timing)\n", rtt[0] / 1000.0,
+                rtt[nrtt / 2] / 1000.0, g_profile.low_latency ? "low-latency" : "default");
+        }
+
+        AtCommand urlCmd;
+        AT_BEGIN(&urlCmd, "AT+HTTPPARA=\"URL\",\"");
+        at_quoted(&urlCmd, http_url);
+        AT_LIT(&urlCmd, "\"");
+        if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000) ||
+            !send_at_command(serial.hCom, "AT+HTTPINIT") || !wait_for_response(&rxBuffer, "OK", 5000) ||
+            !send_at_command(serial.hCom, "AT+HTTPPARA=\"SSLCFG\",1") || !wait_for_response(&rxBuffer, "OK", 5000) ||
+            !at_send(serial.hCom, &urlCmd) || !wait_for_response(&rxBuffer, "OK", 1000)) {
+            printf("HTTP setup failed\n");
+            serial_session_stop(&serial, &rxBuffer, hThread);
+            return 1;
+        }
+
+        for (int it = 0; it < iterations; ++it) {
+            int status = 0;
+            long long length = 0;
+            TransferStats st;
+            log_printf(LOG_PROGRESS, "\nIteration %d/%d\n", it + 1, iterations);
+
+            LONGLONG action_start = mono_now_us();
+            if (!send_at_command(serial.hCom, "AT+HTTPACTION=0") ||
+                !wait_for_http_action(&rxBuffer, &status, &length, 60000)) {
+                printf("  HTTPACTION timed out\n");
+                break;
+            }
+            double fetch_s = (double)(mono_now_us() - action_start) / 1000000.0;
+            if (status != 200 || length <= 0) {
+                printf("  HTTP status %d, length %lld; skipping\n", status, length);
+                continue;
+            }
+
+            transfer_stats_begin(&st, "speedtest", baudRate);
+            if (!http_read_body(serial.hCom, &rxBuffer, NULL, length, &st)) {
+                printf("  HTTPREAD failed\n");
+                break;
+            }
+            transfer_stats_end(&st);
+
+            double secs = (double)(st.end_us - st.start_us) / 1000000.0;
+            if (secs <= 0.0) secs = 1e-6;
+            fetch[completed] = fetch_s;
+            rate[completed] = (double)st.payload_bytes / secs;
+            efficiency[completed] = rate[completed] * 10.0 / (double)baudRate * 100.0;
+            log_printf(LOG_PROGRESS, "  fetch %.3f s, %lld bytes in %.2f s, %.1f KB/s, serial efficiency %.1f%%, %lld heap allocations, %lld overruns\n",
+                fetch_s, length, secs, rate[completed] / 1024.0, efficiency[completed], (long long)st.heap_allocs,
+                (long long)st.overruns);
+            completed++;
+        }
+
+        send_at_command(serial.hCom, "AT+HTTPTERM");
+        wait_for_response(&rxBuffer, "OK", 5000);
+        serial_session_stop(&serial, &rxBuffer, hThread);
+    }
+
+    if (completed == 0) {
+        printf("\nNo successful iterations\n");
+        return 1;
+    }
+
+    const char* names[3] = { "Fetch time (s)", "Throughput (KB/s)", "Serial efficiency (%)" };
+    double* series[3] = { fetch, rate, efficiency };
+    double scale[3] = { 1.0, 1.0 / 1024.0, 1.0 };
+    printf("\nResults over %d iteration(s):\n", completed);
+    printf("  %-22s %10s %10s %10s %10s\n", "", "min", "mean", "max", "stddev");
+    for (int k = 0; k < 3; ++k) {
+        double mn = series[k][0] * scale[k], mx = mn, sum = 0.0, sq = 0.0;
+        for (int i = 0; i < completed; ++i) {
+            double v = series[k][i] * scale[k];
+            if (v < mn) mn = v;
+            if (v > mx) mx = v;
+            sum += v;
+        }
+        double mean = sum / completed;
+        for (int i = 0; i < completed; ++i) {
+            double d = series[k][i] * scale[k] - mean;
+            sq += d * d;
+        }
+        printf("  %-22s %10.3f %10.3f %10.3f %10.3f\n", names[k], mn, mean, mx, sqrt(sq / completed));
+    }
+    return 0;
+}
+
+// Profile store: one line per device,
+//   <key> imei=<imei> baud=<n> rtscts=<0|1> read=<n> block=<n> lowlat=<0|1> pace=<n> gap=<n> kbps=<x>
+// Returns 1 and fills 'p' if 'key' has a stored profile.
+int profile_load(const char* path, const char* key, DeviceProfile* p) {
+    FILE* f = NULL;
+    char line[512];
+    int found = 0;
+    if (fopen_s(&f, path, "r") != 0) return 0;
+    while (!found && fgets(line, sizeof(line), f)) {
+        char* next = NULL;
+        char* tok = strtok_s(line, " \t\r\n", &next);
+        if (!tok || _stricmp(tok, key) != 0) continue;
+        DeviceProfile q = g_profile;
+        snprintf(q.key, sizeof(q.key), "%s", tok);
+        q.imei[0] = '\0';
+        while ((tok = strtok_s(NULL, " \t\r\n", &next)) != NULL) {
+            char* eq = strchr(tok, '=');
+            if (!eq) continue;
+            *eq++ = '\0';
+            if (strcmp(tok, "imei") == 0) snprintf(q.imei, sizeof(q.imei), "%s", eq);
+            else if (strcmp(tok, "baud") == 0) q.baud = atoi(eq);
+            else if (strcmp(tok, "rtscts") == 0) q.rtscts = atoi(eq) ? 1 : 0;
+            else if (strcmp(tok, "read") == 0) q.read_size = atoi(eq);
+            else if (strcmp(tok, "block") == 0) q.upload_block = atoi(eq);
+            else if (strcmp(tok, "lowlat") == 0) q.low_latency = atoi(eq) ? 1 : 0;
+            else if (strcmp(tok, "pace") == 0) q.pace_bps = atoi(eq);
+            else if (strcmp(tok, "gap") == 0) q.pace_gap_ms = atoi(eq);
+            else if (strcmp(tok, "kbps") == 0) q.kbps = atof(eq);
+        }
+        if (q.baud > 0 && q.read_size > 0 && q.upload_block > 0) {
+            *p = q;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Store 'p', replacing any previous line for the same key.
+int profile_save(const char* path, const DeviceProfile* p) {
+    char tmp_path[MAX_PATH];
+    char line[512];
+    FILE* in = NULL;
+    FILE* out = NULL;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (fopen_s(&out, tmp_path, "w") != 0) return 0;
+    if (fopen_s(&in, path, "r") == 0) {
+        while (fgets(line, sizeof(line), in)) {
+            size_t klen = strcspn(line, " \t\r\n");
+            if (klen == strlen(p->key) && _strnicmp(line, p->key, klen) == 0) continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s imei=%s baud=%d rtscts=%d read=%d block=%d lowlat=%d pace=%d gap=%d kbps=%.1f\n", p->key,
+        p->imei[0] ? p->imei : "-", p->baud, p->rtscts, p->read_size, p->upload_block, p->low_latency,
+        p->pace_bps, p->pace_gap_ms, p->kbps);
+    fclose(out);
+    return MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) ? 1 : 0;
+}
+
+// AT+CGSN: the module's IMEI, a line of digits before OK.
+int query_imei(HANDLE hCom, RingBuffer* rb, char* imei, int size) {
+    char line[256];
+    Timer deadline;
+    imei[0] = '\0';
+    if (!send_at_command(hCom, "AT+CGSN")) return 0;
+    deadline_start(&deadline, 2000);
+    while (!deadline_expired(&deadline)) {
+        if (!read_line_from_buffer(rb, line, sizeof(line))) {
+            ring_buffer_wait(rb, &deadline, 0);
+            continue;
+        }
+        log_rx_line(line);
+        at_span_line();
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] && strspn(line, "0123456789") == strlen(line)) {
+            snprintf(imei, size, "%s", line);
+        }
+        else if (strcmp(line, "OK") == 0 || strstr(line, "ERROR")) {
+            deadline_cancel(&deadline);
+            at_span_end(line);
+            return imei[0] != '\0';
+        }
+    }
+    at_span_end("timeout");
+    return 0;
+}
+
+// Probe with AT until the module answers OK (e.g. right after it reboots).
+// Returns 1 as soon as it does, 0 after 'timeout_ms'.
+int module_wait_ready(SerialPort* serial, RingBuffer* rb, DWORD timeout_ms) {
+    Timer deadline;
+    deadline_start(&deadline, timeout_ms);
+    while (!deadline_expired(&deadline)) {
+        if (serial->hCom == INVALID_HANDLE_VALUE || !send_at_command(serial->hCom, "AT")) {
+            ring_buffer_wait(rb, &deadline, READY_PROBE_MS);
+            continue;
+        }
+        if (wait_for_response(rb, "OK", READY_PROBE_MS)) {
+            deadline_cancel(&deadline);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Move the module and the host port to 'baud' / 'rtscts': AT+IFC and AT+IPR
+// at the current settings, then reopen the port and check that AT answers.
+int tune_switch(SerialPort* serial, RingBuffer* rb, HANDLE* hThread, const char* portName, int* cur_baud,
+    int baud, int rtscts) {
+    AtCommand ipr_cmd;
+    const char* ifc = rtscts ? "AT+IFC=2,2" : "AT+IFC=0,0";
+    if (!send_at_command(serial->hCom, ifc) || !wait_for_response(rb, "OK", 1000)) return 0;
+    AT_BEGIN(&ipr_cmd, "AT+IPR=");
+    at_int(&ipr_cmd, baud);
+    if (!at_send(serial->hCom, &ipr_cmd) || !wait_for_response(rb, "OK", 1000)) return 0;
+    if (serial->running) serial_session_stop(serial, rb, *hThread);
+    g_profile.rtscts = rtscts;
+    *cur_baud = baud;
+    Sleep(100); // let the module switch its UART
+    if (!serial_session_start(serial, rb, portName, baud, hThread)) return 0;
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        if (send_at_command(serial->hCom, "AT") && wait_for_response(rb, "OK", 500)) return 1;
+    }
+    return 0;
+}
+
+// After a failed switch the module may be at either rate: find it again
+// and put it back at 'baud' without flow control.
+int tune_recover(SerialPort* serial, RingBuffer* rb, HANDLE* hThread, const char* portName, int* cur_baud,
+    int tried_baud, int baud) {
+    int candidates[3] = { *cur_baud, tried_baud, baud };
+    for (int c = 0; c < 3; ++c) {
+        if (serial->running) serial_session_stop(serial, rb, *hThread);
+        g_profile.rtscts = 0;
+        *cur_baud = candidates[c];
+        if (!serial_session_start(serial, rb, portName, candidates[c], hThread)) return 0;
+        if (send_at_command(serial->hCom, "AT") && wait_for_response(rb, "OK", 500) &&
+            send_at_command(serial->hCom, "AT+IFC=0,0") && wait_for_response(rb, "OK", 500)) {
+            return candidates[c] == baud ? 1 : tune_switch(serial, rb, hThread, portName, cur_baud, baud, 0);
+        }
+    }
+    return 0;
+}
+
+// Tune: sweep baud rate x flow control x HTTPREAD size against a device
+// (or the simulator), store the fastest error-free setting as the device's
+// profile. Usage: tune <COM> <HTTP_URL> [BAUD] [--bauds a,b,..] [--profiles FILE]
+//                 tune SIM <BYTES> [--bauds a,b,..] [--profiles FILE]
+int run_tune(int argc, char** argv) {
+    SerialPort serial;
+    RingBuffer rxBuffer;
+    HANDLE hThread = NULL;
+    const char* portName = NULL;
+    const char* target = NULL;
+    int baudRate = 115200;
+    int bauds[TUNE_MAX_BAUDS] = { 115200, 460800, 921600 };
+    int nbauds = 3;
+    static const int read_sizes[] = { 2048, 4096, 10240, 16384 };
+    const int nreads = (int)(sizeof(read_sizes) / sizeof(read_sizes[0]));
+    int npos = 0;
+    long long length = 0;
+    int start_baud;
+    DeviceProfile best;
+
+    memset(&serial, 0, sizeof(serial));
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--bauds") == 0 && i + 1 < argc) {
+            char list[256];
+            char* next = NULL;
+            snprintf(list, sizeof(list), "%s", argv[++i]);
+            nbauds = 0;
+            for (char* tok = strtok_s(list, ",", &next); tok && nbauds < TUNE_MAX_BAUDS; tok = strtok_s(NULL, ",", &next)) {
+                if (atoi(tok) > 0) bauds[nbauds++] = atoi(tok);
+            }
+        }
+        else if (strcmp(argv[i], "--profiles") == 0 && i + 1 < argc) {
+            g_profile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--low-latency") == 0) {
+            g_profile.low_latency = 1;
+        }
+        else if (strcmp(argv[i], "--rx-priority") == 0 || strcmp(argv[i], "--rx-cpu") == 0) {
+            if (rx_placement_option(argc, argv, &i) < 0) return 1;
+        }
+        else if (npos == 0) { portName = argv[i]; npos++; }
+        else if (npos == 1) { target = argv[i]; npos++; }
+        else if (npos == 2) {
+            int b = atoi(argv[i]);
+            if (b > 0) baudRate = b;
+            npos++;
+        }
+    }
+    if (!portName || !target || nbauds == 0) {
+        printf("Usage: %s tune <COM> <HTTP_URL> [BAUD] [--bauds a,b,..] [--profiles FILE]\n", argv[0]);
+        printf("       %s tune SIM <BYTES> [--bauds a,b,..] [--profiles FILE]\n", argv[0]);
+        return 1;
+    }
+    int simulated = _stricmp(portName, "SIM") == 0;
+    // A raw TCP serial server keeps its own UART settings: AT+IPR would move the module off them
+    int fixed_link = net_port_kind(portName) == NET_RAW;
+    if (fixed_link) {
+        log_printf(LOG_PROGRESS, "%s cannot change the line settings; sweeping HTTPREAD sizes at %d baud only\n",
+            portName, baudRate);
+        bauds[0] = baudRate;
+        nbauds = 1;
+    }
+    start_baud = baudRate;
+
+    log_printf(LOG_PROGRESS, "=== SIMCOM Link Tuning ===\n\n");
+    metrics_attach_thread(metrics_register_device(portName));
+    DeviceMetrics* metrics = metrics_current_device();
+    best = g_profile;
+    best.kbps = 0.0;
+    snprintf(best.key, sizeof(best.key), "%s", portName);
+
+    if (simulated) {
+        // The simulator models a UART with working flow control
+        if (!parse_size(target, &length) || length <= 0) {
+            printf("Invalid simulated body size: %s\n", target);
+            return 1;
+        }
+        best.imei[0] = '\0';
+    }
+    else {
+        log_printf(LOG_PROGRESS, "Opening serial port %s at %d baud...\n", portName, baudRate);
+        g_profile.rtscts = 0;
+        if (!serial_session_start(&serial, &rxBuffer, portName, baudRate, &hThread)) return 1;
+        AtCommand urlCmd;
+        AT_BEGIN(&urlCmd, "AT+HTTPPARA=\"URL\",\"");
+        at_quoted(&urlCmd, target);
+        AT_LIT(&urlCmd, "\"");
+        if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000) ||
+            !query_imei(serial.hCom, &rxBuffer, best.imei, sizeof(best.imei)) ||
+            !send_at_command(serial.hCom, "AT+HTTPINIT") || !wait_for_response(&rxBuffer, "OK", 5000) ||
+            !send_at_command(serial.hCom, "AT+HTTPPARA=\"SSLCFG\",1") || !wait_for_response(&rxBuffer, "OK", 5000) ||
+            !at_send(serial.hCom, &urlCmd) || !wait_for_response(&rxBuffer, "OK", 1000)) {
+            printf("Device setup failed\n");
+            serial_session_stop(&serial, &rxBuffer, hThread);
+            return 1;
+        }
+        log_printf(LOG_PROGRESS, "Module IMEI %s\n", best.imei);
+    }
+
+    printf("\n  %-8s %-7s %-6s %10s %8s  %s\n", "baud", "flow", "read", "KB/s", "errors", "result");
+    for (int b = 0; b < nbauds; ++b) {
+        for (int flow = simulated ? 1 : 0; flow <= (fixed_link ? 0 : 1); ++flow) {
+            if (!simulated && !fixed_link && !tune_switch(&serial, &rxBuffer, &hThread, portName, &baudRate, bauds[b], flow)) {
+                printf("  %-8d %-7s %-6s %10s %8s  %s\n", bauds[b], flow ? "rtscts" : "none", "-", "-", "-",
+                    "no response");
+                // Recover at the settings we started from
+                if (!tune_recover(&serial, &rxBuffer, &hThread, portName, &baudRate, bauds[b], start_baud)) {
+                    if (serial.running) serial_session_stop(&serial, &rxBuffer, hThread);
+                    printf("Lost the device; check which baud rate it answers at and rerun\n");
+                    return 1;
+                }
+                continue;
+            }
+            for (int r = 0; r < nreads; ++r) {
+                TransferStats st;
+                LONG64 errors_before = metrics ? metrics_get(metrics, MET_LINE_ERRORS) : 0;
+                int ok;
+                g_profile.read_size = read_sizes[r];
+                if (simulated) {
+                    ok = simulate_read_body(length, bauds[b], SIM_COMMAND_LATENCY_MS, read_sizes[r], &st);
+                }
+                else {
+                    int status = 0;
+                    ok = send_at_command(serial.hCom, "AT+HTTPACTION=0") &&
+                        wait_for_http_action(&rxBuffer, &status, &length, 60000) && status == 200 && length > 0;
+                    if (ok) {
+                        transfer_stats_begin(&st, "tune", bauds[b]);
+                        ok = http_read_body(serial.hCom, &rxBuffer, NULL,
+                            length < TUNE_SAMPLE_BYTES ? length : TUNE_SAMPLE_BYTES, &st);
+                        transfer_stats_end(&st);
+                    }
+                }
+                LONG64 errors = (metrics ? metrics_get(metrics, MET_LINE_ERRORS) : 0) - errors_before;
+                double secs = (double)(st.end_us - st.start_us) / 1000000.0;
+                double kbps = ok && secs > 0.0 ? (double)st.payload_bytes / 1024.0 / secs : 0.0;
+                int better = ok && errors == 0 && kbps > best.kbps;
+                printf("  %-8d %-7s %-6d %10.1f %8lld  %s\n", bauds[b], flow ? "rtscts" : "none", read_sizes[r],
+                    kbps, (long long)errors, !ok ? "failed" : better ? "best so far" : "");
+                if (better) {
+                    best.baud = bauds[b];
+                    best.rtscts = flow;
+                    best.read_size = read_sizes[r];
+                    best.kbps = kbps;
+                }
+                if (!ok && !simulated) break;
+            }
+        }
+    }
+
+    if (best.kbps <= 0.0) {
+        printf("\nNo setting completed without errors; profile not changed\n");
+        if (serial.running) serial_session_stop(&serial, &rxBuffer, hThread);
+        return 1;
+    }
+    if (serial.running) {
+        // Leave the module at the chosen settings so later runs can open straight at them
+        if (best.baud != baudRate || best.rtscts != g_profile.rtscts) {
+            tune_switch(&serial, &rxBuffer, &hThread, portName, &baudRate, best.baud, best.rtscts);
+        }
+        send_at_command(serial.hCom, "AT+HTTPTERM");
+        wait_for_response(&rxBuffer, "OK", 5000);
+        serial_session_stop(&serial, &rxBuffer, hThread);
+    }
+
+    g_profile = best;
+    printf("\nBest: %d baud, %s, HTTPREAD %d, %.1f KB/s\n", best.baud, best.rtscts ? "RTS/CTS" : "no flow control",
+        best.read_size, best.kbps);
+    if (!profile_save(g_profile_path, &best)) {
+        printf("Failed to write %s\n", g_profile_path);
+        return 1;
+    }
+    printf("Profile for %s saved to %s\n", best.key, g_profile_path);
+    return 0;
+}
+
+// Keep the LFOTA pace learned on 'portName' for the next run. The stored
+// baud rate is only filled in when the port had no profile yet.
+void pace_remember(const char* portName, int baudRate, int profile_loaded) {
+    static SRWLOCK lock = SRWLOCK_INIT;     // devices running side by side share the file
+    snprintf(g_profile.key, sizeof(g_profile.key), "%s", portName);
+    if (!profile_loaded) g_profile.baud = baudRate;
+    AcquireSRWLockExclusive(&lock);
+    if (!profile_save(g_profile_path, &g_profile)) {
+        printf("Failed to write %s\n", g_profile_path);
+    }
+    ReleaseSRWLockExclusive(&lock);
+}
+
+// Copy the string value of "key" in a flat JSON object into 'out',
+// decoding escapes (\uXXXX as UTF-8). Returns 1 if the key was found and
+// its value fits.
+int json_string_field(const char* json, const char* key, char* out, int size) {
+    size_t klen = strlen(key);
+    const char* p = json;
+
+    while ((p = strchr(p, '"')) != NULL) {
+        const char* name = ++p;
+        while (*p && *p != '"') {
+            if (*p == '\\' && p[1]) p++;
+            p++;
+        }
+        if (!*p) return 0;
+        const char* v = ++p;
+        while (*v == ' ' || *v == '\t') v++;
+        if (*v != ':' || (size_t)(p - 1 - name) != klen || strncmp(name, key, klen) != 0) continue;
+        v++;
+        while (*v == ' ' || *v == '\t') v++;
+        if (*v++ != '"') return 0;
+
+        int n = 0;
+        while (*v && *v != '"') {
+            char buf[3];
+            int len = 1;
+            buf[0] = *v++;
+            if (buf[0] == '\\') {
+                char e = *v++;
+                if (e == 'n') buf[0] = '\n';
+                else if (e == 't') buf[0] = '\t';
+                else if (e == 'r') buf[0] = '\r';
+                else if (e == 'b') buf[0] = '\b';
+                else if (e == 'f') buf[0] = '\f';
+                else if (e == 'u') {
+                    unsigned cp = 0;
+                    for (int k = 0; k < 4; ++k, ++v) {
+                        if (!isxdigit((unsigned char)*v)) return 0;
+                        cp = cp * 16 + (isdigit((unsigned char)*v) ? *v - '0' : (tolower((unsigned char)*v) - 'a' + 10));
+                    }
+                    if (cp < 0x80) buf[0] = (char)cp;
+                    else if (cp < 0x800) {
+                        buf[0] = (char)(0xC0 | (cp >> 6));
+                        buf[1] = (char)(0x80 | (cp & 0x3F));
+                        len = 2;
+                    }
+                    else {
+                        buf[0] = (char)(0xE0 | (cp >> 12));
+                        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                        buf[2] = (char)(0x80 | (cp & 0x3F));
+                        len = 3;
+                    }
+                }
+                else if (e) buf[0] = e;     // \" \\ \/
+                else return 0;
+            }
+            if (n + len >= size) return 0;
+            memcpy(out + n, buf, len);
+            n += len;
+        }
+        if (*v != '"') return 0;
+        out[n] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+// SHA-256 of the file at 'path' as lowercase hex ('hex' holds 65 bytes).
+// Returns 1 on success.
+int file_sha256(const char* path, char* hex) {
+    BCRYPT_ALG_HANDLE alg = NULL;
+    BCRYPT_HASH_HANDLE hash = NULL;
+    unsigned char digest[32];
+    SessionArena* arena = arena_current();
+    char* buf = arena_block_get(arena, ARENA_BLOCK_SIZE);
+    FILE* f = NULL;
+    size_t n;
+    int ok = 0;
+
+    if (!buf || fopen_s(&f, path, "rb") != 0) goto done;
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&alg, BCRYPT_SHA256_ALGORITHM, NULL, 0)) ||
+        !BCRYPT_SUCCESS(BCryptCreateHash(alg, &hash, NULL, 0, NULL, 0, 0))) {
+        goto done;
+    }
+    while ((n = fread(buf, 1, ARENA_BLOCK_SIZE, f)) > 0) {
+        if (!BCRYPT_SUCCESS(BCryptHashData(hash, (unsigned char*)buf, (ULONG)n, 0))) goto done;
+    }
+    if (ferror(f) || !BCRYPT_SUCCESS(BCryptFinishHash(hash, digest, sizeof(digest), 0))) goto done;
+    for (int i = 0; i < 32; ++i) snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    ok = 1;
+
+done:
+    if (hash) BCryptDestroyHash(hash);
+    if (alg) BCryptCloseAlgorithmProvider(alg, 0);
+    if (f) fclose(f);
+    arena_block_put(arena, buf);
+    return ok;
+}
+
+// One manifest entry. Duplicated URLs point 'source' at the entry that
+// fetches them; the others copy its file.
+typedef struct {
+    char* url;
+    char dest[MAX_PATH];
+    char sha256[65];    // expected digest in hex, or empty
+    int line;           // manifest line number
+    int source;
+    int ok;
+} BatchItem;
+
+void batch_free(BatchItem* items, int n) {
+    if (!items) return;
+    for (int i = 0; i < n; ++i) free(items[i].url);
+    free(items);
+}
+
+// Read a JSONL manifest, one {"url": ..., "dest": ..., "sha256": ...}
+// object per line ("sha256" optional, blank lines skipped). Returns the
+// number of items, stored in a heap array at *out, or -1 on error.
+int batch_load(const char* path, BatchItem** out) {
+    FILE* f = NULL;
+    char line[8192];
+    char url[4096];
+    BatchItem* items;
+    int n = 0;
+    int lineno = 0;
+
+    if (fopen_s(&f, path, "r") != 0) {
+        printf("Unable to open manifest %s\n", path);
+        return -1;
+    }
+    items = (BatchItem*)calloc(BATCH_MAX_ITEMS, sizeof(BatchItem));
+    if (!items) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        const char* p = line;
+        lineno++;
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p) continue;
+        if (n >= BATCH_MAX_ITEMS) {
+            printf("Manifest has more than %d items\n", BATCH_MAX_ITEMS);
+            goto fail;
+        }
+        BatchItem* it = &items[n];
+        if (!json_string_field(p, "url", url, sizeof(url)) || !json_string_field(p, "dest", it->dest, sizeof(it->dest))) {
+            printf("Manifest line %d: needs \"url\" and \"dest\" strings\n", lineno);
+            goto fail;
+        }
+        if (json_string_field(p, "sha256", it->sha256, sizeof(it->sha256)) && strlen(it->sha256) != 64) {
+            printf("Manifest line %d: \"sha256\" must be 64 hex digits\n", lineno);
+            goto fail;
+        }
+        it->url = _strdup(url);
+        it->line = lineno;
+        n++;
+        if (!it->url) goto fail;
+    }
+    fclose(f);
+    *out = items;
+    return n;
+
+fail:
+    fclose(f);
+    batch_free(items, n);
+    return -1;
+}
+
+// Order by URL, so fetches from one server run back to back and
+// duplicates end up adjacent; manifest order breaks ties.
+static int batch_compare(const void* a, const void* b) {
+    const BatchItem* x = (const BatchItem*)a;
+    const BatchItem* y = (const BatchItem*)b;
+    int c = strcmp(x->url, y->url);
+    return c != 0 ? c : x->line - y->line;
+}
+
+// Fetch one URL into 'dest' on an initialized HTTP session. The body
+// length comes from +HTTPACTION, which saves the HTTPHEAD round trip; a
+// length of 0 is streamed until the module reports the end of the body.
+int batch_fetch(SerialPort* serial, RingBuffer* rb, const char* url, const char* dest, int baudRate) {
+    AtCommand urlCmd;
+    TransferStats st;
+    int status = 0;
+    long long length = 0;
+
+    AT_BEGIN(&urlCmd, "AT+HTTPPARA=\"URL\",\"");
+    at_quoted(&urlCmd, url);
+    AT_LIT(&urlCmd, "\"");
+    if (!at_send(serial->hCom, &urlCmd) || !wait_for_response(rb, "OK", 1000)) {
+        printf("  Setting the URL failed\n");
+        return 0;
+    }
+    if (!send_at_command(serial->hCom, "AT+HTTPACTION=0") || !wait_for_http_action(rb, &status, &length, 60000)) {
+        printf("  HTTPACTION timed out\n");
+        return 0;
+    }
+    if (status != 200) {
+        printf("  HTTP status %d\n", status);
+        return 0;
+    }
+    transfer_stats_begin(&st, "download", baudRate);
+    if (!download_file_data(serial->hCom, rb, dest, 0, length > 0 ? length : -1, &st)) return 0;
+    transfer_stats_end(&st);
+    double secs = (double)(st.end_us - st.start_us) / 1000000.0;
+    log_printf(LOG_PROGRESS, "  %lld bytes in %.2f s, %.1f KB/s\n", st.payload_bytes, secs,
+        secs > 0.0 ? (double)st.payload_bytes / 1024.0 / secs : 0.0);
+    return 1;
+}
+
+// batch <COM> <MANIFEST> [BAUD]: fetch every entry of a JSONL manifest
+// within one HTTP session. Port, handshake, HTTPINIT and HTTPTERM happen
+// once; per item only HTTPPARA="URL" and HTTPACTION repeat. A URL listed
+// more than once is fetched once and copied to the other destinations.
+int run_batch(int argc, char** argv) {
+    SerialPort serial;
+    RingBuffer rxBuffer;
+    HANDLE hThread;
+    const char* portName = NULL;
+    const char* manifest = NULL;
+    int baudRate = 115200;
+    int baud_given = 0;
+    int npos = 0;
+    BatchItem* items = NULL;
+    int nitems;
+    int unique = 0;
+    int fetched = 0;
+    int copied = 0;
+    int failed = 0;
+
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--profiles") == 0 && i + 1 < argc) {
+            g_profile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            int level = log_level_from_name(argv[++i]);
+            if (level < 0) {
+                printf("Unknown log level '%s' (quiet, progress, protocol, hexdump)\n", argv[i]);
+                return 1;
+            }
+            g_log_level = level;
+        }
+        else if (strcmp(argv[i], "--low-latency") == 0) {
+            g_profile.low_latency = 1;
+        }
+        else if (strcmp(argv[i], "--rx-priority") == 0 || strcmp(argv[i], "--rx-cpu") == 0) {
+            if (rx_placement_option(argc, argv, &i) < 0) return 1;
+        }
+        else if (npos == 0) { portName = argv[i]; npos++; }
+        else if (npos == 1) { manifest = argv[i]; npos++; }
+        else if (npos == 2) {
+            int b = atoi(argv[i]);
+            if (b > 0) {
+                baudRate = b;
+                baud_given = 1;
+            }
+            npos++;
+        }
+    }
+    if (!portName || !manifest) {
+        printf("Usage: %s batch <COM> <MANIFEST.jsonl> [BAUD] [--profiles FILE] [--log-level LEVEL]\n", argv[0]);
+        return 1;
+    }
+
+    nitems = batch_load(manifest, &items);
+    if (nitems <= 0) {
+        if (nitems == 0) printf("Manifest %s has no items\n", manifest);
+        batch_free(items, 0);
+        return 1;
+    }
+    qsort(items, nitems, sizeof(BatchItem), batch_compare);
+    for (int i = 0; i < nitems; ++i) {
+        items[i].source = i;
+        if (i > 0 && strcmp(items[i].url, items[i - 1].url) == 0) items[i].source = items[i - 1].source;
+        else unique++;
+    }
+
+    int low_latency = g_profile.low_latency;
+    if (profile_load(g_profile_path, portName, &g_profile) && !baud_given) baudRate = g_profile.baud;
+    if (low_latency) g_profile.low_latency = 1;
+
+    log_printf(LOG_PROGRESS, "=== SIMCOM HTTP Batch Download ===\n\n");
+    log_printf(LOG_PROGRESS, "%d items, %d unique URLs\n", nitems, unique);
+    metrics_attach_thread(metrics_register_device(portName));
+    log_printf(LOG_PROGRESS, "Opening serial port %s at %d baud...\n", portName, baudRate);
+    if (!serial_session_start(&serial, &rxBuffer, portName, baudRate, &hThread)) {
+        batch_free(items, nitems);
+        return 1;
+    }
+    if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000) ||
+        !send_at_command(serial.hCom, "AT+HTTPINIT") || !wait_for_response(&rxBuffer, "OK", 5000) ||
+        !send_at_command(serial.hCom, "AT+HTTPPARA=\"SSLCFG\",1") || !wait_for_response(&rxBuffer, "OK", 5000)) {
+        printf("HTTP setup failed\n");
+        serial_session_stop(&serial, &rxBuffer, hThread);
+        batch_free(items, nitems);
+        return 1;
+    }
+
+    for (int i = 0; i < nitems; ++i) {
+        BatchItem* it = &items[i];
+        log_printf(LOG_PROGRESS, "\n[%d/%d] %s -> %s\n", i + 1, nitems, it->url, it->dest);
+        if (it->source != i) {
+            BatchItem* src = &items[it->source];
+            it->ok = src->ok && CopyFileA(src->dest, it->dest, FALSE);
+            if (!it->ok) printf("  Copy from %s failed\n", src->dest);
+        }
+        else {
+            it->ok = batch_fetch(&serial, &rxBuffer, it->url, it->dest, baudRate);
+            if (!it->ok && (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 2000))) {
+                printf("Module not responding; skipping the remaining items\n");
+                failed += nitems - i;
+                break;
+            }
+        }
+        if (it->ok && it->sha256[0]) {
+            char hex[65];
+            if (!file_sha256(it->dest, hex) || _stricmp(hex, it->sha256) != 0) {
+                printf("  SHA-256 mismatch for %s (manifest line %d)\n", it->dest, it->line);
+                it->ok = 0;
+            }
+        }
+        if (!it->ok) failed++;
+        else if (it->source != i) copied++;
+        else fetched++;
+    }
+
+    send_at_command(serial.hCom, "AT+HTTPTERM");
+    wait_for_response(&rxBuffer, "OK", 5000);
+    serial_session_stop(&serial, &rxBuffer, hThread);
+    batch_free(items, nitems);
+
+    printf("\nBatch: %d fetched, %d copied, %d failed\n", fetched, copied, failed);
+    return failed ? 1 : 0;
+}
+
+// Fleet scheduling. Modules updated side by side share the site's cellular
+// capacity (HTTPACTION fetches the body), the host's USB bus and its disk
+// (HTTPREAD and the LFOTA upload). Past some number of holders a resource
+// only gets slower for everyone, so each admits a limited number of phases.
+// The limit is learned: a finished phase reports its bytes, and the average
+// number of holders during it gives the aggregate rate at that concurrency.
+// The limit climbs while one more holder still adds FLEET_GAIN_PCT and drops
+// back once it costs throughput. A free slot goes to the waiter nearest
+// completion (an upload before a download before a fetch), so updated
+// modules leave the line as early as possible.
+enum { RES_CELLULAR, RES_USB, RES_DISK, FLEET_RESOURCES };
+#define FLEET_CELLULAR (1 << RES_CELLULAR)
+#define FLEET_USB (1 << RES_USB)
+#define FLEET_DISK (1 << RES_DISK)
+
+enum { STAGE_FETCH, STAGE_DOWNLOAD, STAGE_UPLOAD, FLEET_STAGES };    // by work left
+
+static const char* fleet_resource_names[FLEET_RESOURCES] = { "cellular", "usb", "disk" };
+
+typedef struct {
+    int limit;                  // phases admitted at once
+    int holders;
+    double busy;                // holders integrated over time, holder-seconds
+    LONGLONG busy_us;           // when 'busy' was last brought up to date
+    double rate[WATCH_MAX_UNITS + 1];   // smoothed aggregate bytes/s seen at each holder count
+} FleetResource;
+
+typedef struct {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+    FleetResource res[FLEET_RESOURCES];
+    int waiters[FLEET_STAGES][FLEET_RESOURCES];
+    int max_limit;
+} Fleet;
+
+// What the calling thread holds, for fleet_release.
+typedef struct {
+    int mask;
+    LONGLONG start_us;
+    double busy[FLEET_RESOURCES];
+} FleetHold;
+
+static Fleet* g_fleet;          // NULL: a single device, nothing is shared
+static __declspec(thread) FleetHold t_hold;
+
+// 'start' may hold a starting limit per resource (0 = FLEET_START_LIMIT).
+void fleet_init(Fleet* f, int max_limit, const int* start) {
+    memset(f, 0, sizeof(*f));
+    InitializeCriticalSection(&f->lock);
+    InitializeConditionVariable(&f->changed);
+    f->max_limit = max_limit;
+    for (int r = 0; r < FLEET_RESOURCES; ++r) {
+        int limit = start && start[r] > 0 ? start[r] : FLEET_START_LIMIT;
+        f->res[r].limit = limit < max_limit ? limit : max_limit;
+        f->res[r].busy_us = mono_now_us();
+    }
+}
+
+static void fleet_advance(FleetResource* r, LONGLONG now) {
+    r->busy += r->holders * (double)(now - r->busy_us) / 1000000.0;
+    r->busy_us = now;
+}
+
+static int fleet_admits(Fleet* f, int mask, int stage) {
+    for (int r = 0; r < FLEET_RESOURCES; ++r) {
+        if (!(mask & (1 << r))) continue;
+        if (f->res[r].holders >= f->res[r].limit) return 0;
+        for (int s = stage + 1; s < FLEET_STAGES; ++s) {
+            if (f->waiters[s][r]) return 0;     // a module closer to done goes first
+        }
+    }
+    return 1;
+}
+
+// 'aggregate' bytes/s were moved with 'level' holders on average.
+static void fleet_learn(FleetResource* r, int level, double aggregate, int max_limit) {
+    r->rate[level] = r->rate[level] > 0.0 ? r->rate[level] * 0.7 + aggregate * 0.3 : aggregate;
+    if (level != r->limit) return;
+    double below = r->limit > 1 ? r->rate[r->limit - 1] : 0.0;
+    if (below > 0.0 && r->rate[r->limit] < below) {
+        r->limit--;
+    }
+    else if (r->limit < max_limit && r->rate[r->limit] >= below * (100 + FLEET_GAIN_PCT) / 100) {
+        r->limit++;
+    }
+}
+
+// Wait until every resource in 'mask' admits one more phase of 'stage'.
+void fleet_acquire(int mask, int stage) {
+    Fleet* f = g_fleet;
+    if (!f || !mask) return;
+    EnterCriticalSection(&f->lock);
+    for (int r = 0; r < FLEET_RESOURCES; ++r) {
+        if (mask & (1 << r)) f->waiters[stage][r]++;
+    }
+    while (!fleet_admits(f, mask, stage)) {
+        SleepConditionVariableCS(&f->changed, &f->lock, INFINITE);
+    }
+    LONGLONG now = mono_now_us();
+    for (int r = 0; r < FLEET_RESOURCES; ++r) {
+        if (!(mask & (1 << r))) continue;
+        f->waiters[stage][r]--;
+        fleet_advance(&f->res[r], now);
+        f->res[r].holders++;
+        t_hold.busy[r] = f->res[r].busy;
+    }
+    t_hold.mask = mask;
+    t_hold.start_us = now;
+    WakeAllConditionVariable(&f->changed);      // the waiter counts changed
+    LeaveCriticalSection(&f->lock);
+}
+
+// Give back what the thread holds; 'bytes' were moved while holding it
+// (0 = nothing to learn from, e.g. the phase failed).
+void fleet_release(long long bytes) {
+    Fleet* f = g_fleet;
+    if (!f || !t_hold.mask) return;
+    EnterCriticalSection(&f->lock);
+    LONGLONG now = mono_now_us();
+    double secs = (double)(now - t_hold.start_us) / 1000000.0;
+    for (int r = 0; r < FLEET_RESOURCES; ++r) {
+        if (!(t_hold.mask & (1 << r))) continue;
+        FleetResource* res = &f->res[r];
+        fleet_advance(res, now);
+        res->holders--;
+        if (bytes > 0 && secs * 1000.0 >= FLEET_MIN_SAMPLE_MS) {
+            int level = (int)((res->busy - t_hold.busy[r]) / secs + 0.5);
+            if (level < 1) level = 1;
+            if (level > f->max_limit) level = f->max_limit;
+            fleet_learn(res, level, (double)bytes / secs * level, f->max_limit);
+        }
+    }
+    t_hold.mask = 0;
+    WakeAllConditionVariable(&f->changed);
+    LeaveCriticalSection(&f->lock);
+}
+
+// One device from handshake to verified update: download the image,
+// upload it over LFOTA, let CFOTA flash it and check the new firmware.
+// main runs one; watch mode runs one per attached module, each on its own
+// thread (the profile, report and job are per thread).
+typedef struct {
+    char port[128];
+    const char* url;
+    char filename[MAX_PATH];
+    int baud;
+    int baud_given;             // the baud rate overrides a tuned profile
+    int low_latency;
+    int pace;                   // --pace, -1 = learned
+    int pace_gap;               // --pace-gap, -1 = from the profile
+    const char* report_path;    // NULL = no report
+    const char* job_key;        // entry in the open job store, NULL = none
+    char imei[32];              // the module's if already identified, else empty
+    int ok;                     // set once the run completed
+} DeviceRun;
+
+// Success is run->ok; the report is written whichever way it ends.
+void run_device(DeviceRun* run) {
+    SerialPort serial;
+    RingBuffer rxBuffer;
+    HANDLE hThread;
+    long long file_size = 0;
+    const char* portName = run->port;
+    const char* http_url = run->url;
+    const char* http_filename = run->filename;
+    int baudRate = run->baud;
+    const char* report_path = run->report_path;
+    int pace = run->pace;
+    DeviceMetrics* metrics = NULL;
+    LONGLONG phase_start = 0;
+    TransferStats download_stats;
+    TransferStats upload_stats;
+    int pace_learning = 0;
+    int lfota_attempt = 0;
+    RunReport report;
+    char cgmr_line[256] = { 0 };
+    char validator[128];
+    long long action_length = -1;   // body length from +HTTPACTION
+    Job* job = NULL;
+    int resume_phase = JOB_NEW;
+    long long resume_offset = 0;    // bytes of the image kept from an interrupted download
+
+    run->ok = 0;
+    if (report_path) {
+        report_begin(&report);
+        report.phase = "open";
+    }
+
+    // A profile stored by `tune` supplies the link settings unless the baud rate was given
+    int profile_loaded = profile_load(g_profile_path, portName, &g_profile);
+    if (run->low_latency) g_profile.low_latency = 1;
+    if (run->pace_gap >= 0) g_profile.pace_gap_ms = run->pace_gap;
+    if (profile_loaded) {
+        if (!run->baud_given) baudRate = g_profile.baud;
+        log_printf(LOG_PROGRESS, "Using tuned profile for %s: %d baud, %s, HTTPREAD %d, upload block %d%s\n", portName,
+            baudRate, g_profile.rtscts ? "RTS/CTS" : "no flow control", g_profile.read_size, g_profile.upload_block,
+            g_profile.low_latency ? ", low-latency timing" : "");
+    }
+
+    // A job log from an interrupted run says where to pick this device up
+    if (run->job_key) {
+        if ((job = job_attach(run->job_key, http_url, http_filename)) == NULL) {
+            printf("Unable to track the job for %s\n", run->job_key);
+            goto report;
+        }
+        resume_phase = job->phase;
+        if (resume_phase == JOB_DONE) {
+            log_printf(LOG_PROGRESS, "Job for %s already completed\n", run->job_key);
+            run->ok = 1;
+            if (report_path) {
+                report.success = 1;
+                report.phase = "done";
+            }
+            goto report;
+        }
+        long long have = file_length(http_filename);
+        if (resume_phase == JOB_DOWNLOAD) {
+            resume_offset = job->offset < have ? job->offset : have;
+            if (resume_offset < 0) resume_offset = 0;
+            // Without an ETag or date there is no telling whether the server's file is still the same
+            if (!job->validator[0]) resume_offset = 0;
+        }
+        else if (resume_phase == JOB_UPLOAD && have != job->total) {
+            resume_phase = JOB_DOWNLOAD;    // the image is gone or changed
+        }
+        if (resume_phase != JOB_NEW) {
+            log_printf(LOG_PROGRESS, "Resuming job for %s at phase %s (offset %lld)\n", run->job_key,
+                job_phase_names[resume_phase], resume_phase == JOB_DOWNLOAD ? resume_offset : job->offset);
+        }
+    }
+
+    metrics = metrics_register_device(run->imei[0] ? run->imei : portName);
+    metrics_attach_thread(metrics);
+
+    // Open serial port and start receiver thread
+    log_printf(LOG_PROGRESS, "Opening serial port %s at %d baud...\n", portName, baudRate);
+    if (!serial_session_start(&serial, &rxBuffer, portName, baudRate, &hThread)) {
+        goto report;
+    }
+    snprintf(serial.imei, sizeof(serial.imei), "%s", run->imei);
+
+    log_printf(LOG_PROGRESS, "Serial port opened successfully\n");
+
+    // An update in flight may leave the module silent: skip the handshake
+    if (resume_phase == JOB_VERIFY) goto job_verify;
+    if (resume_phase == JOB_CFOTA) goto job_cfota;
+
+    // Execute AT command sequence
+    log_printf(LOG_PROGRESS, "\nStarting AT command sequence...\n");
+
+    // 1. Send AT
+    phase_start = mono_now_us();
+    if (report_path) report.phase = "handshake";
+    log_printf(LOG_PROGRESS, "\n1. Sending AT command...\n");
+    if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000)) {
+        if (baudRate == run->baud) {
+            printf("AT command failed\n");
+            goto cleanup;
+        }
+        // The profile was tuned for another module; a new one still runs at the default rate
+        log_printf(LOG_PROGRESS, "No answer at the tuned %d baud; retrying at %d baud without flow control\n",
+            baudRate, run->baud);
+        serial_session_stop(&serial, &rxBuffer, hThread);
+        baudRate = run->baud;
+        g_profile.rtscts = 0;
+        if (!serial_session_start(&serial, &rxBuffer, portName, baudRate, &hThread)) {
+            goto report;
+        }
+        snprintf(serial.imei, sizeof(serial.imei), "%s", run->imei);
+        if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000)) {
+            printf("AT command failed\n");
+            goto cleanup;
+        }
+    }
+    // The IMEI also tells a renumbered port of this module from another's after AT+CRESET
+    if (query_imei(serial.hCom, &rxBuffer, serial.imei, sizeof(serial.imei)) && profile_loaded &&
+        g_profile.imei[0] && strcmp(g_profile.imei, "-") != 0) {
+        // The profile was tuned for one module; a different one on the same port keeps only the link settings
+        if (strcmp(serial.imei, g_profile.imei) != 0) {
+            log_printf(LOG_PROGRESS, "Module IMEI %s differs from the tuned one (%s); using default transfer sizes\n",
+                serial.imei, g_profile.imei);
+            g_profile.read_size = HTTPREAD_DEFAULT_SIZE;
+            g_profile.upload_block = ARENA_BLOCK_SIZE;
+            g_profile.pace_bps = 0;
+        }
+    }
+
+    // After basic AT OK, query firmware version and subscribe (CGMR then CSUB)
+    log_printf(LOG_PROGRESS, "\n1a. Querying firmware version (AT+CGMR)...\n");
+    if (!send_at_command(serial.hCom, "AT+CGMR") ||
+        !wait_for_response_capture(&rxBuffer, "OK", "+CGMR:", cgmr_line, sizeof(cgmr_line), 2000)) {
+        printf("AT+CGMR failed or no OK\n");
+        goto cleanup;
+    }
+    if (report_path) report_firmware(report.fw_before, sizeof(report.fw_before), cgmr_line);
+
+    log_printf(LOG_PROGRESS, "\n1b. Sending AT+CSUB...\n");
+    if (!send_at_command(serial.hCom, "AT+CSUB") || !wait_for_response(&rxBuffer, "OK", 2000)) {
+        printf("AT+CSUB failed or no OK\n");
+        goto cleanup;
+    }
+
+    if (resume_phase == JOB_UPLOAD) {
+        file_size = job->total;
+        log_printf(LOG_PROGRESS, "\n%s already holds the image (%lld bytes); skipping the download\n", http_filename,
+            file_size);
+        goto job_upload;
+    }
+
+    // 2. Send AT+HTTPINIT
+    log_printf(LOG_PROGRESS, "\n2. Starting HTTP service...\n");
+    if (!send_at_command(serial.hCom, "AT+HTTPINIT") || !wait_for_response(&rxBuffer, "OK", 5000)) {
+        printf("Failed to start HTTP service\n");
+        goto cleanup;
+    }
+
+    // 3. Send AT+HTTPPARA="SSLCFG",1
+    log_printf(LOG_PROGRESS, "\n3. Set SSL configuration...\n");
+    if (!send_at_command(serial.hCom, "AT+HTTPPARA=\"SSLCFG\",1") || !wait_for_response(&rxBuffer, "OK", 5000)) {
+        printf("Failed to set SSL configuration\n");
+        goto cleanup;
+    }
+
+    // 4. Send URL
+    log_printf(LOG_PROGRESS, "\n4. Logging into HTTP server...\n");
+    {
+        AtCommand loginCmd;
+        // Construct login command using HTTP parameters from CLI or interactive input
+        AT_BEGIN(&loginCmd, "AT+HTTPPARA=\"URL\",\"");
+        at_quoted(&loginCmd, http_url);
+        AT_LIT(&loginCmd, "\"");
+        if (!at_send(serial.hCom, &loginCmd) || !wait_for_response(&rxBuffer, "OK", 1000)) {
+            printf("HTTP login failed\n");
+            goto cleanup;
+        }
+    }
+    if (resume_offset > 0) {
+        // Ask only for the rest of the body
+        AtCommand rangeCmd;
+        AT_BEGIN(&rangeCmd, "AT+HTTPPARA=\"USERDATA\",\"Range: bytes=");
+        at_int(&rangeCmd, resume_offset);
+        AT_LIT(&rangeCmd, "-");
+        // A changed file then comes back whole (200). An ETag is quoted and cannot go in an AT string;
+        // the comparison after HTTPHEAD covers it.
+        if (!strchr(job->validator, '"')) {
+            AT_LIT(&rangeCmd, "\\r\\nIf-Range: ");
+            at_quoted(&rangeCmd, job->validator);
+        }
+        AT_LIT(&rangeCmd, "\"");
+        if (!at_send(serial.hCom, &rangeCmd) || !wait_for_response(&rxBuffer, "OK", 1000)) {
+            log_printf(LOG_PROGRESS, "Range request not accepted; downloading from the start\n");
+            resume_offset = 0;
+        }
+    }
+
+    metrics_phase(metrics, PHASE_HANDSHAKE, phase_start);
+
+    // 5. Set AT+HTTPACTION
+http_action:
+    phase_start = mono_now_us();
+    if (report_path) report.phase = "http_action";
+    log_printf(LOG_PROGRESS, "\n5. Set AT+HTTPACTION...\n");
+    {
+        int http_status = 0;
+        fleet_acquire(FLEET_CELLULAR, STAGE_FETCH);
+        if (!send_at_command(serial.hCom, "AT+HTTPACTION=0") ||
+            !wait_for_http_action(&rxBuffer, &http_status, &action_length, 10000) ||
+            (http_status != 200 && !(http_status == 206 && resume_offset > 0))) {
+            if (report_path) report.http_status = http_status;
+            printf("Failed to set AT+HTTPACTION\n");
+            goto cleanup;
+        }
+        fleet_release(action_length);
+        if (report_path) report.http_status = http_status;
+        if (http_status == 200 && resume_offset > 0) {
+            log_printf(LOG_PROGRESS, "Server sent the whole file (range ignored or file changed); downloading from the start\n");
+            resume_offset = 0;
+        }
+    }
+
+    // 6. Get file size; with neither a Content-Length nor a length in +HTTPACTION the body is streamed
+    log_printf(LOG_PROGRESS, "\n6. Get file size...\n");
+    if (!send_at_command(serial.hCom, "AT+HTTPHEAD") ||
+        !read_http_head(&rxBuffer, &file_size, validator, sizeof(validator), 1000)) {
+        printf("Failed to complete HTTPHEAD command\n");
+        goto cleanup;
+    }
+    if (resume_offset > 0 && strcmp(validator, job->validator) != 0) {
+        // The server sent the rest of a different file (it ignored If-Range, or none could be sent)
+        log_printf(LOG_PROGRESS, "The file changed on the server (%s, was %s); downloading from the start\n",
+            validator[0] ? validator : "no validator", job->validator);
+        resume_offset = 0;
+        if (!send_at_command(serial.hCom, "AT+HTTPPARA=\"USERDATA\",\"\"") ||
+            !wait_for_response(&rxBuffer, "OK", 1000)) {
+            printf("Failed to clear the Range header\n");
+            goto cleanup;
+        }
+        goto http_action;
+    }
+    job_validator(validator);
+    if (file_size < 0 && action_length > 0) {
+        // Chunked responses have no Content-Length, but the module counted what it buffered
+        file_size = action_length;
+    }
+    if (file_size >= 0) {
+        file_size += resume_offset;     // a 206 carries the length of the rest
+        log_printf(LOG_PROGRESS, "Total file size: %lld bytes\n", file_size);
+        if (resume_offset > 0) log_printf(LOG_PROGRESS, "Resuming download at byte %lld\n", resume_offset);
+        if (report_path) report.content_length = file_size;
+    }
+    else {
+        log_printf(LOG_PROGRESS, "No body length; streaming until the module reports the end of the body\n");
+    }
 
-        // Send download command
-        sprintf_s(command, sizeof(command), "AT+HTTPREAD=0,10240");
-        if (!send_at_command(hCom, command)) {
-            printf("Failed to send command\n");
-            fclose(file);
-            return 0;
+    metrics_phase(metrics, PHASE_HTTP_ACTION, phase_start);
+
+    // 7. Download file
+    log_printf(LOG_PROGRESS, "\n7. Start downloading file...\n");
+    fleet_acquire(FLEET_USB | FLEET_DISK, STAGE_DOWNLOAD);
+    phase_start = mono_now_us();
+    if (report_path) report.phase = "download";
+    transfer_stats_begin(&download_stats, "download", baudRate);
+    job_phase(JOB_DOWNLOAD, resume_offset, file_size);
+    if (!download_file_data(serial.hCom, &rxBuffer, http_filename, resume_offset,
+            file_size < 0 ? -1 : file_size - resume_offset, &download_stats)) {
+        metrics_phase(metrics, PHASE_DOWNLOAD, phase_start);
+        printf("File download failed\n");
+        goto cleanup;
+    }
+    metrics_phase(metrics, PHASE_DOWNLOAD, phase_start);
+    fleet_release(download_stats.payload_bytes);
+    transfer_stats_end(&download_stats);
+    transfer_report(&download_stats);
+    if (file_size < 0) file_size = resume_offset + download_stats.payload_bytes;
+    job_phase(JOB_UPLOAD, 0, file_size);
+    if (report_path) {
+        report.download_bytes = download_stats.payload_bytes;
+        report.download_s = (double)(download_stats.end_us - download_stats.start_us) / 1000000.0;
+        report.phase = "upload";
+    }
+
+    // After successful download, perform LFOTA upload sequence:
+    // 1) Terminate HTTP
+    log_printf(LOG_PROGRESS, "\n8. Terminating HTTP service...\n");
+    if (!send_at_command(serial.hCom, "AT+HTTPTERM") || !wait_for_response(&rxBuffer, "OK", 5000)) {
+        printf("AT+HTTPTERM failed\n");
+        goto cleanup;
+    }
+
+job_upload:
+    // Without CTS nothing stops the upload from overrunning the module's UART intake.
+    // Pace it with a token bucket: start from the learned pace (probing a little above
+    // it) or the wire rate, back off after a lost upload and remember what worked.
+    // A pace given with --pace is backed off on loss like a learned pace but never stored.
+    if (!g_profile.rtscts && pace != 0) {
+        int wire_bps = baudRate / 10;
+        if (pace > 0) g_profile.pace_bps = pace;
+        else if (g_profile.pace_bps > 0) g_profile.pace_bps = (int)((long long)g_profile.pace_bps * PACE_PROBE_PCT / 100);
+        if (g_profile.pace_bps <= 0 || g_profile.pace_bps > wire_bps) g_profile.pace_bps = wire_bps;
+        pace_learning = pace < 0;
+    }
+    else {
+        g_profile.pace_bps = 0;
+    }
+
+lfota_retry:
+    ++lfota_attempt;
+
+    // 2) Notify module of incoming LFOTA size: AT+LFOTA=0,size
+    {
+        AtCommand lfota_cmd;
+        AT_BEGIN(&lfota_cmd, "AT+LFOTA=0,");
+        at_int(&lfota_cmd, file_size);
+        log_printf(LOG_PROGRESS, "Sending: AT+LFOTA=0,%lld\n", file_size);
+        if (!at_send(serial.hCom, &lfota_cmd) || !wait_for_response(&rxBuffer, "OK", 5000)) {
+            printf("AT+LFOTA=0 failed\n");
+            goto cleanup;
         }
+    }
 
-        int data_received = 0;
-        int expecting_data = 1;
+    // 3) Request to start LFOTA transfer: AT+LFOTA=1,size -> expect '>' prompt
+    {
+        AtCommand lfota_cmd;
+        fleet_acquire(FLEET_USB | FLEET_DISK, STAGE_UPLOAD);
+        phase_start = mono_now_us();
+        transfer_stats_begin(&upload_stats, "upload", baudRate);
+        AT_BEGIN(&lfota_cmd, "AT+LFOTA=1,");
+        at_int(&lfota_cmd, file_size);
+        log_printf(LOG_PROGRESS, "Sending: AT+LFOTA=1,%lld\n", file_size);
+        if (!at_send(serial.hCom, &lfota_cmd)) {
+            printf("Failed to send AT+LFOTA=1 command\n");
+            goto cleanup;
+        }
+        upload_stats.commands = 1;
+        upload_stats.wire_bytes = (long long)at_length(&lfota_cmd);
 
-        while (expecting_data) {
-            if (!read_line_from_buffer(rb, line, sizeof(line))) {
-                Sleep(1);
-                continue;
+        // Wait for '>' prompt indicating module is ready to receive binary data
+        if (!wait_for_response(&rxBuffer, ">", 10000)) {
+            printf("Did not receive '>' prompt for LFOTA data\n");
+            goto cleanup;
+        }
+        upload_stats.wait_us += mono_now_us() - upload_stats.start_us;
+
+        // 4) Stream the file with double-buffered overlapped writes (no gaps between blocks)
+        if (g_profile.pace_bps > 0) {
+            log_printf(LOG_PROGRESS, "Starting LFOTA upload of %lld bytes (paced at %d B/s, attempt %d)...\n", file_size,
+                g_profile.pace_bps, lfota_attempt);
+        }
+        else {
+            log_printf(LOG_PROGRESS, "Starting LFOTA upload of %lld bytes (streamed)...\n", file_size);
+        }
+        FILE* f = NULL;
+        if (fopen_s(&f, http_filename, "rb") != 0) {
+            printf("Unable to open file for LFOTA: %s\n", http_filename);
+            goto cleanup;
+        }
+
+        // Use helper to write and drain the serial output queue
+        int write_and_drain(HANDLE hCom, FILE* src, long long len, DWORD write_timeout_ms, DWORD drain_timeout_ms,
+            Progress* progress, TransferStats* stats);
+        Progress upload_progress;
+        log_printf(LOG_PROGRESS, "WriteFile (streamed) -> write_and_drain...\n");
+        LONGLONG upload_start = mono_now_us();
+        progress_begin(&upload_progress, "upload", "B", file_size);
+        int upload_ok = write_and_drain(serial.hCom, f, file_size, 30000, 30000, &upload_progress, &upload_stats);
+        progress_end(&upload_progress);
+        fclose(f);
+        if (!upload_ok) {
+            trace_span("lfota", "LFOTA upload", upload_start, file_size, "failed");
+            printf("LFOTA streamed write or drain failed\n");
+            goto cleanup;
+        }
+        trace_span("lfota", "LFOTA upload", upload_start, file_size, NULL);
+
+        // 5) After data sent, wait for final OK from module
+        LONGLONG ack_start = mono_now_us();
+        int lfota_ok = wait_for_response(&rxBuffer, "OK", 20000);
+        trace_span("lfota", "await LFOTA OK", ack_start, -1, lfota_ok ? "OK" : "timeout");
+        metrics_phase(metrics, PHASE_UPLOAD, phase_start);
+        fleet_release(lfota_ok ? file_size : 0);
+        if (!lfota_ok) {
+            if (g_profile.pace_bps > 0) {
+                int lost_pace = g_profile.pace_bps;
+                g_profile.pace_bps = (int)((long long)lost_pace * PACE_BACKOFF_PCT / 100);
+                if (g_profile.pace_bps < PACE_MIN_BPS) g_profile.pace_bps = PACE_MIN_BPS;
+                if (pace_learning) {
+                    pace_remember(portName, baudRate, profile_loaded);
+                    profile_loaded = 1;
+                }
+                // Retry once the module is back in command mode
+                if (lfota_attempt < PACE_MAX_ATTEMPTS && send_at_command(serial.hCom, "AT") &&
+                    wait_for_response(&rxBuffer, "OK", 2000)) {
+                    log_printf(LOG_PROGRESS, "LFOTA upload lost data at %d B/s; retrying at %d B/s\n", lost_pace,
+                        g_profile.pace_bps);
+                    metrics_add(MET_RETRIES, 1);
+                    goto lfota_retry;
+                }
             }
+            printf("LFOTA transfer did not complete (no OK)\n");
+            goto cleanup;
+        }
+        if (pace_learning) {
+            pace_remember(portName, baudRate, profile_loaded);
+            log_printf(LOG_PROGRESS, "LFOTA pace %d B/s stored for %s\n", g_profile.pace_bps, portName);
+        }
+        upload_stats.wait_us += mono_now_us() - ack_start;
+        upload_stats.payload_bytes = file_size;
+        upload_stats.wire_bytes += file_size;
+        transfer_stats_end(&upload_stats);
+        transfer_report(&upload_stats);
+        if (report_path) {
+            report.upload_bytes = upload_stats.payload_bytes;
+            report.upload_s = (double)(upload_stats.end_us - upload_stats.start_us) / 1000000.0;
+            report.phase = "cfota";
+        }
+    }
 
-            printf("Received: %s", line);
+    // 6) Reboot module and monitor CFOTA progress. A resumed update that
+    // already finished shows as a module answering AT.
+job_cfota:
+    {
+        if (resume_phase == JOB_CFOTA && module_wait_ready(&serial, &rxBuffer, READY_PROBE_MS * 4)) {
+            log_printf(LOG_PROGRESS, "Module answers AT; the interrupted update has finished\n");
+            goto job_verify;
+        }
+        if (resume_phase == JOB_CFOTA) {
+            log_printf(LOG_PROGRESS, "Resuming CFOTA monitoring...\n");
+        }
+        else {
+            log_printf(LOG_PROGRESS, "Sending AT+CRESET to reboot module...\n");
+            if (!send_at_command(serial.hCom, "AT+CRESET")) {
+                printf("Failed to send AT+CRESET\n");
+                goto cleanup;
+            }
+            job_phase(JOB_CFOTA, 0, 0);
+        }
 
-            if (strstr(line, "+HTTPREAD: ") != NULL) {
-                // Parse data length
-                const char* data_pos = strstr(line, "+HTTPREAD: ");
-                if (data_pos) {
-                    data_pos += 11;
-                    int data_len = atoi(data_pos);
+        // Monitor module reports: +CFOTA: UPDATE:<process> and +CFOTA: UPDATE SUCCESS, then QCRDY
+        log_printf(LOG_PROGRESS, "Waiting for CFOTA progress and completion (this may take several minutes)...\n");
+        int got_update_success = 0;
+        int got_qcrdy = 0;
+        int last_progress = -1;
+        char cfota_line[256];
+        Timer cfota_deadline;
+        // When the port had to be reopened, QCRDY may have been sent while it
+        // was away: after the update succeeded, probe with AT instead
+        LONG cfota_reconnects = serial.reconnects;
+        int ready_probing = 0;
+        Timer ready_probe;
+        // CFOTA phases for the trace: reboot -> update -> restart (until QCRDY)
+        Progress cfota_progress;
+        progress_begin(&cfota_progress, "cfota", "%", 100);
+        const char* cfota_phase = "cfota reboot";
+        LONGLONG cfota_phase_start = mono_now_us();
+        phase_start = cfota_phase_start;
+        const DWORD CFOTA_OVERALL_TIMEOUT_MS = 10 * 60 * 1000; // 10 minutes
 
-                    if (data_len > 0) {
-                        // Read binary data
-                        char* data = (char*)malloc(data_len);
-                        int bytes_read = 0;
+        deadline_start(&cfota_deadline, CFOTA_OVERALL_TIMEOUT_MS);
+        while (!got_qcrdy && !deadline_expired(&cfota_deadline)) {
+            if (serial.reconnects != cfota_reconnects) {
+                cfota_reconnects = serial.reconnects;
+                if (ready_probing) deadline_cancel(&ready_probe);
+                deadline_start(&ready_probe, CFOTA_READY_GRACE_MS);
+                ready_probing = 1;
+            }
+            if (ready_probing && got_update_success && deadline_expired(&ready_probe)) {
+                send_at_command(serial.hCom, "AT");
+                deadline_restart(&ready_probe, READY_PROBE_MS);
+            }
+            if (read_line_from_buffer(&rxBuffer, cfota_line, sizeof(cfota_line))) {
+                log_rx_line(cfota_line);
 
-                        while (bytes_read < data_len) {
-                            if (ring_buffer_get(rb, &data[bytes_read])) {
-                                bytes_read++;
-                            }
-                            else {
-                                Sleep(1);
-                            }
-                        }
+                if (ready_probing && got_update_success && strncmp(cfota_line, "OK", 2) == 0) {
+                    got_qcrdy = 1;
+                    if (report_path) report_cfota_event(&report, "qcrdy", -1);
+                    trace_span("cfota", cfota_phase, cfota_phase_start, -1, "AT OK");
+                    log_printf(LOG_PROGRESS, "Module answers AT after reconnecting (QCRDY not seen)\n");
+                    break;
+                }
 
-                        // Print 16-byte-per-line hex view with offset relative to bytes already received
-                        for (int i = 0; i < data_len; ++i) {
-                            if ((i % 16) == 0) {
-                                // display the starting offset for this line
-                                printf("\n%08X: ", bytes_received + i);
-                            }
-                            printf("%02X ", (unsigned char)data[i]);
+                // Check for progress lines like: +CFOTA: UPDATE:<n>
+                const char* p = strstr(cfota_line, "+CFOTA: UPDATE:");
+                if (p) {
+                    p += strlen("+CFOTA: UPDATE:");
+                    while (*p && !isdigit((unsigned char)*p)) p++;
+                    if (*p) {
+                        int v = atoi(p);
+                        if (strcmp(cfota_phase, "cfota reboot") == 0) {
+                            trace_span("cfota", cfota_phase, cfota_phase_start, -1, NULL);
+                            cfota_phase = "cfota update";
+                            cfota_phase_start = mono_now_us();
+                        }
+                        if (v != last_progress) {
+                            trace_instant("cfota", "progress", v);
+                            PROBE_CFOTA_PROGRESS(v);
+                            alog_event(EV_CFOTA_PROGRESS, v, 0, NULL, 0);
+                            last_progress = v;
+                            progress_update(&cfota_progress, v);
+                            if (report_path) report_cfota_event(&report, "progress", v);
+                        }
+                        if (v >= 100) {
+                            // progress indicates finished; wait for explicit SUCCESS message
                         }
-                        printf("\n");
+                    }
+                    continue;
+                }
 
-                        // Write to file
-                        fwrite(data, 1, data_len, file);
-                        fflush(file);
+                // Check for explicit success message
+                if (strstr(cfota_line, "+CFOTA: UPDATE SUCCESS") != NULL) {
+                    got_update_success = 1;
+                    if (report_path) report_cfota_event(&report, "success", -1);
+                    trace_span("cfota", cfota_phase, cfota_phase_start, -1, "SUCCESS");
+                    cfota_phase = "cfota restart";
+                    cfota_phase_start = mono_now_us();
+                    log_printf(LOG_PROGRESS, "CFOTA update reported SUCCESS\n");
+                    continue;
+                }
 
-                        data_received += data_len;
-                        bytes_received += data_len;
-                        free(data);
+                // Check for QCRDY (module ready after reboot/update)
+                if (strstr(cfota_line, "QCRDY") != NULL) {
+                    got_qcrdy = 1;
+                    if (report_path) report_cfota_event(&report, "qcrdy", -1);
+                    trace_span("cfota", cfota_phase, cfota_phase_start, -1, "QCRDY");
+                    log_printf(LOG_PROGRESS, "Module reported QCRDY\n");
+                    break;
+                }
+            }
+            else {
+                ring_buffer_wait(&rxBuffer, &cfota_deadline, ready_probing ? READY_PROBE_MS : 0);
+            }
+        }
+        deadline_cancel(&cfota_deadline);
+        if (ready_probing) deadline_cancel(&ready_probe);
+
+        progress_end(&cfota_progress);
+        if (!got_qcrdy) {
+            trace_span("cfota", cfota_phase, cfota_phase_start, -1, "timeout");
+        }
+        metrics_phase(metrics, PHASE_CFOTA, phase_start);
+        if (!got_update_success) {
+            printf("Did not observe CFOTA UPDATE SUCCESS within timeout\n");
+            goto cleanup;
+        }
+        if (!got_qcrdy) {
+            printf("Did not observe QCRDY within timeout\n");
+            goto cleanup;
+        }
+        job_phase(JOB_VERIFY, 0, 0);
+    }
+
+job_verify:
+    {
+        // After QCRDY, verify as soon as the module answers AT, then query firmware and subscribe
+        LONGLONG settle_start = mono_now_us();
+        phase_start = settle_start;
+        if (report_path) report.phase = "verify";
+        int module_ready = module_wait_ready(&serial, &rxBuffer, POST_UPDATE_READY_MS);
+        trace_span("cfota", "post-update ready", settle_start, -1, module_ready ? NULL : "timeout");
+        if (!module_ready) {
+            printf("Module did not answer AT after update\n");
+            goto cleanup;
+        }
+        log_printf(LOG_PROGRESS, "Querying firmware version after update (AT+CGMR)...\n");
+        cgmr_line[0] = '\0';
+        if (!send_at_command(serial.hCom, "AT+CGMR") ||
+            !wait_for_response_capture(&rxBuffer, "OK", "+CGMR:", cgmr_line, sizeof(cgmr_line), 5000)) {
+            printf("AT+CGMR failed or no OK after update\n");
+            goto cleanup;
+        }
+        if (report_path) report_firmware(report.fw_after, sizeof(report.fw_after), cgmr_line);
+
+        log_printf(LOG_PROGRESS, "Sending AT+CSUB after update...\n");
+        if (!send_at_command(serial.hCom, "AT+CSUB") || !wait_for_response(&rxBuffer, "OK", 5000)) {
+            printf("AT+CSUB failed or no OK after update\n");
+            goto cleanup;
+        }
+        metrics_phase(metrics, PHASE_VERIFY, phase_start);
+        job_phase(JOB_DONE, 0, 0);
+    }
+
+    log_printf(LOG_PROGRESS, "\n=== All operations completed ===\n");
+    run->ok = 1;
+    if (report_path) {
+        report.success = 1;
+        report.phase = "done";
+    }
+
+cleanup:
+    // Cleanup resources
+    serial_session_stop(&serial, &rxBuffer, hThread);
+    fleet_release(0);
+report:
+    if (report_path) {
+        report.retries = metrics ? metrics_get(metrics, MET_RETRIES) : 0;
+        report.line_errors = metrics ? metrics_get(metrics, MET_LINE_ERRORS) : 0;
+        report.overruns = metrics ? metrics_get(metrics, MET_OVERRUNS) : 0;
+        report_write(&report, report_path);
+    }
+    metrics_attach_thread(NULL);
+    metrics_release_device(metrics);
+    t_report = NULL;    // the thread may go on to another device
+    t_job = NULL;
+}
+
+// Watch mode: wait for modules to be plugged in and update each one as it
+// arrives. Ports present at start are left alone. Every new port becomes a
+// task that probes it with AT; the module's other interfaces (diagnostics,
+// NMEA) stay silent and are dropped. A module is identified by its IMEI, so
+// its second AT port and the ports it re-enumerates with during CFOTA are
+// not mistaken for a new module, and one that was already updated this
+// session is not flashed again. An identified module's update is queued
+// behind the probe that found it.
+//
+// Tasks run on a pool of workers, each with its own deque: the owner takes
+// from the back (the update it just queued runs next, on the same thread),
+// an idle worker steals from the front of another's, so nothing waits
+// behind a long update while a worker is free. The fleet scheduler decides
+// when each phase of an update may use the shared links.
+typedef struct Watch Watch;
+
+enum { UNIT_FREE, UNIT_QUEUED, UNIT_FINISHED };
+
+typedef struct {
+    volatile LONG state;
+    int number;
+    int claimed;                // probed and identified; the task is now its update
+    char imei[32];
+    LONGLONG start_us;
+    char report_path[MAX_PATH];
+    DeviceRun run;
+} WatchUnit;
+
+typedef struct {
+    CRITICAL_SECTION lock;
+    WatchUnit* tasks[WATCH_MAX_TASKS];
+    int head;                   // thieves take here
+    int tail;                   // the owner pushes and takes here
+    HANDLE thread;
+    Watch* watch;
+    int index;
+} WatchWorker;
+
+struct Watch {
+    CRITICAL_SECTION lock;
+    DeviceProfile profile;      // defaults and command-line overrides for every unit
+    DeviceRun templ;            // url, baud, pace; filename and report are patterns
+    const char* report_pattern;
+    int use_jobs;
+    int claims;
+    WatchUnit units[WATCH_MAX_TASKS];
+    char done[WATCH_DONE_MAX][32];      // IMEIs updated this session
+    LONGLONG done_seen_us[WATCH_DONE_MAX];
+    int ndone;
+    WatchWorker workers[WATCH_MAX_UNITS];
+    int nworkers;
+    HANDLE work;                // set when tasks are queued
+    volatile LONG shutdown;
+};
+
+static volatile LONG g_watch_stop = 0;
+
+static BOOL WINAPI watch_ctrl_handler(DWORD type) {
+    if (type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT) return FALSE;
+    InterlockedExchange(&g_watch_stop, 1);
+    return TRUE;
+}
+
+// "dir/fw.bin" + "861234..." -> "dir/fw_861234....bin"
+void watch_unit_path(const char* pattern, const char* tag, char* out, int size) {
+    const char* base = strrchr(pattern, '\\');
+    const char* slash = strrchr(pattern, '/');
+    if (!base || (slash && slash > base)) base = slash;
+    const char* dot = strrchr(base ? base : pattern, '.');
+    if (!dot || dot == (base ? base + 1 : pattern)) dot = pattern + strlen(pattern);
+    snprintf(out, size, "%.*s_%s%s", (int)(dot - pattern), pattern, tag, dot);
+}
+
+static void watch_push(WatchWorker* k, WatchUnit* u) {
+    EnterCriticalSection(&k->lock);
+    k->tasks[k->tail++ % WATCH_MAX_TASKS] = u;
+    LeaveCriticalSection(&k->lock);
+    SetEvent(k->watch->work);
+}
+
+static WatchUnit* watch_take(WatchWorker* k, int steal) {
+    WatchUnit* u = NULL;
+    EnterCriticalSection(&k->lock);
+    if (k->head != k->tail) u = steal ? k->tasks[k->head++ % WATCH_MAX_TASKS] : k->tasks[--k->tail % WATCH_MAX_TASKS];
+    LeaveCriticalSection(&k->lock);
+    return u;
+}
+
+// Was 'imei' updated this session? A hit counts as seen now, so a module that
+// keeps turning up is not forgotten. Caller holds the lock.
+static int watch_done_seen(Watch* w, const char* imei) {
+    for (int i = 0; i < w->ndone; ++i) {
+        if (strcmp(w->done[i], imei) == 0) {
+            w->done_seen_us[i] = mono_now_us();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Remember an updated module; when full, the least recently seen one makes
+// room. Caller holds the lock.
+static void watch_done_mark(Watch* w, const char* imei) {
+    int slot = 0;
+    if (watch_done_seen(w, imei)) return;
+    if (w->ndone < WATCH_DONE_MAX) {
+        slot = w->ndone++;
+    }
+    else {
+        for (int i = 1; i < WATCH_DONE_MAX; ++i) {
+            if (w->done_seen_us[i] < w->done_seen_us[slot]) slot = i;
+        }
+    }
+    snprintf(w->done[slot], sizeof(w->done[0]), "%s", imei);
+    w->done_seen_us[slot] = mono_now_us();
+}
+
+// Probe the unit's port and claim the module behind it. Returns 1 if the
+// module is to be updated.
+static int watch_unit_probe(Watch* w, WatchUnit* u) {
+    SerialPort serial;
+    RingBuffer rxBuffer;
+    HANDLE hThread;
+    int busy = 0;
+
+    metrics_attach_thread(NULL);
+    if (!serial_session_start(&serial, &rxBuffer, u->run.port, u->run.baud, &hThread)) return 0;
+    int answered = module_wait_ready(&serial, &rxBuffer, WATCH_PROBE_MS) &&
+        query_imei(serial.hCom, &rxBuffer, u->imei, sizeof(u->imei));
+    serial_session_stop(&serial, &rxBuffer, hThread);
+    if (!answered) return 0;
+
+    EnterCriticalSection(&w->lock);
+    for (int i = 0; i < WATCH_MAX_TASKS && !busy; ++i) {
+        WatchUnit* o = &w->units[i];
+        busy = o != u && o->state == UNIT_QUEUED && o->claimed && strcmp(o->imei, u->imei) == 0;
+    }
+    if (!busy) busy = watch_done_seen(w, u->imei);
+    if (!busy) {
+        u->claimed = 1;
+        u->number = ++w->claims;
+    }
+    LeaveCriticalSection(&w->lock);
+    return !busy;
+}
+
+static void watch_unit_update(Watch* w, WatchUnit* u) {
+    watch_unit_path(w->templ.filename, u->imei, u->run.filename, sizeof(u->run.filename));
+    if (w->report_pattern) {
+        watch_unit_path(w->report_pattern, u->imei, u->report_path, sizeof(u->report_path));
+        u->run.report_path = u->report_path;
+    }
+    u->run.job_key = w->use_jobs ? u->imei : NULL;
+    snprintf(u->run.imei, sizeof(u->run.imei), "%s", u->imei);
+    printf("[unit %d] %s: module %s attached, updating\n", u->number, u->run.port, u->imei);
+    u->start_us = mono_now_us();
+    run_device(&u->run);     // its metrics are keyed by the IMEI
+    if (u->run.ok) {
+        EnterCriticalSection(&w->lock);
+        watch_done_mark(w, u->imei);
+        LeaveCriticalSection(&w->lock);
+    }
+}
+
+static DWORD WINAPI watch_worker_thread(LPVOID param) {
+    WatchWorker* self = (WatchWorker*)param;
+    Watch* w = self->watch;
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d", self->index + 1);
+    trace_thread_name(name);
+
+    while (!w->shutdown) {
+        WatchUnit* u = watch_take(self, 0);
+        for (int i = 1; !u && i < w->nworkers; ++i) u = watch_take(&w->workers[(self->index + i) % w->nworkers], 1);
+        if (!u) {
+            WaitForSingleObject(w->work, WATCH_IDLE_MS);
+            continue;
+        }
+        g_profile = w->profile;
+        if (!u->claimed) {
+            if (watch_unit_probe(w, u)) {
+                watch_push(self, u);
+                continue;
+            }
+        }
+        else {
+            watch_unit_update(w, u);
+        }
+        InterlockedExchange(&u->state, UNIT_FINISHED);
+    }
+    return 0;
+}
+
+// "--limit usb=4": start the named resource at that limit.
+int fleet_limit_option(const char* arg, int* start) {
+    const char* eq = strchr(arg, '=');
+    for (int r = 0; eq && r < FLEET_RESOURCES; ++r) {
+        if ((size_t)(eq - arg) == strlen(fleet_resource_names[r]) &&
+            _strnicmp(arg, fleet_resource_names[r], eq - arg) == 0 && atoi(eq + 1) > 0) {
+            start[r] = atoi(eq + 1);
+            return 1;
+        }
+    }
+    printf("Bad --limit '%s' (cellular=N, usb=N or disk=N)\n", arg);
+    return 0;
+}
+
+int run_watch(int argc, char** argv) {
+    static Watch w;
+    static Fleet fleet;
+    char known[SERIAL_MAX_PORTS][16];
+    char now[SERIAL_MAX_PORTS][16];
+    char fresh[SERIAL_MAX_PORTS][16];       // new last scan, probed if still there
+    char fresh_next[SERIAL_MAX_PORTS][16];
+    int nknown;
+    int nfresh = 0;
+    int npos = 0;
+    int max_units = WATCH_MAX_UNITS;
+    int count = 0;              // --count: stop after this many modules (0 = until Ctrl+C)
+    int units = 0;
+    int passed = 0;
+    int failed = 0;
+    int next_worker = 0;
+    int start_limits[FLEET_RESOURCES] = { 0 };
+    const char* jobs_path = NULL;
+    HANDLE arrival = NULL;
+    HCMNOTIFICATION notify = NULL;
+    int log_level_given = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.templ.baud = 115200;
+    w.templ.pace = -1;
+    w.templ.pace_gap = -1;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--profiles") == 0 && i + 1 < argc) {
+            g_profile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            int level = log_level_from_name(argv[++i]);
+            if (level < 0) {
+                printf("Unknown log level '%s' (quiet, progress, protocol, hexdump)\n", argv[i]);
+                return 1;
+            }
+            g_log_level = level;
+            log_level_given = 1;
+        }
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+            w.report_pattern = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-units") == 0 && i + 1 < argc) {
+            max_units = atoi(argv[++i]);
+            if (max_units < 1) max_units = 1;
+            if (max_units > WATCH_MAX_UNITS) max_units = WATCH_MAX_UNITS;
+        }
+        else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            if (!fleet_limit_option(argv[++i], start_limits)) return 1;
+        }
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--low-latency") == 0) {
+            w.templ.low_latency = 1;
+        }
+        else if (strcmp(argv[i], "--pace") == 0 && i + 1 < argc) {
+            w.templ.pace = atoi(argv[++i]);
+            if (w.templ.pace < 0) w.templ.pace = 0;
+        }
+        else if (strcmp(argv[i], "--pace-gap") == 0 && i + 1 < argc) {
+            w.templ.pace_gap = atoi(argv[++i]);
+            if (w.templ.pace_gap < 0) w.templ.pace_gap = 0;
+        }
+        else if (strcmp(argv[i], "--rx-priority") == 0 || strcmp(argv[i], "--rx-cpu") == 0) {
+            if (rx_placement_option(argc, argv, &i) < 0) return 1;
+        }
+        else if (npos == 0) { w.templ.url = argv[i]; npos++; }
+        else if (npos == 1) { snprintf(w.templ.filename, sizeof(w.templ.filename), "%s", argv[i]); npos++; }
+        else if (npos == 2) {
+            int b = atoi(argv[i]);
+            if (b > 0) {
+                w.templ.baud = b;
+                w.templ.baud_given = 1;
+            }
+            npos++;
+        }
+    }
+    if (npos < 2) {
+        printf("Usage: %s watch <HTTP_URL> <LOCAL_FILE> [BAUD] [--max-units N] [--limit RES=N] [--count N] "
+            "[--jobs FILE] [--report FILE] [--profiles FILE]\n", argv[0]);
+        return 1;
+    }
+    if (!log_level_given) g_log_level = LOG_QUIET;  // units interleave; keep to the result lines
+    if (jobs_path && !job_store_open(jobs_path)) {
+        printf("Unable to use job store %s\n", jobs_path);
+        return 1;
+    }
+    w.use_jobs = jobs_path != NULL;
+    w.profile = g_profile;
+    InitializeCriticalSection(&w.lock);
+    fleet_init(&fleet, max_units, start_limits);
+    g_fleet = &fleet;
+
+    w.work = CreateEvent(NULL, FALSE, FALSE, NULL);
+    for (int i = 0; i < max_units; ++i) {
+        WatchWorker* k = &w.workers[i];
+        InitializeCriticalSection(&k->lock);
+        k->watch = &w;
+        k->index = i;
+        k->thread = CreateThread(NULL, 0, watch_worker_thread, k, 0, NULL);
+        if (!k->thread) {
+            DeleteCriticalSection(&k->lock);
+            break;
+        }
+        w.nworkers++;
+    }
+    if (!w.work || w.nworkers == 0) {
+        printf("Unable to start worker threads\n");
+        return 1;
+    }
+
+    nknown = serial_port_names(known, SERIAL_MAX_PORTS);
+    printf("=== SIMCOM HTTP Watch ===\n\n");
+    printf("Ignoring %d port(s) already present; plug in modules to update them (Ctrl+C to stop)\n", nknown);
+    SetConsoleCtrlHandler(watch_ctrl_handler, TRUE);
+    arrival = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (arrival) notify = port_arrival_watch(arrival);
+
+    while (1) {
+        int active = 0;
+        // Collect finished units
+        for (int i = 0; i < WATCH_MAX_TASKS; ++i) {
+            WatchUnit* u = &w.units[i];
+            if (u->state == UNIT_QUEUED) active++;
+            if (u->state != UNIT_FINISHED) continue;
+            if (u->claimed) {
+                units++;
+                if (u->run.ok) passed++;
+                else failed++;
+                printf("[unit %d] %s: module %s %s in %.1f s -> %s\n", u->number, u->run.port, u->imei,
+                    u->run.ok ? "updated" : "FAILED", (mono_now_us() - u->start_us) / 1000000.0, u->run.filename);
+            }
+            EnterCriticalSection(&w.lock);
+            u->claimed = 0;
+            u->state = UNIT_FREE;
+            LeaveCriticalSection(&w.lock);
+        }
+        if (g_watch_stop || (count > 0 && units >= count)) {
+            if (!active) break;
+            Sleep(WATCH_POLL_MS);
+            continue;
+        }
 
-                        printf("Received %d bytes, total progress: %d/%d (%.1f%%)\n",
-                            data_len, bytes_received, total_size,
-                            (float)bytes_received / total_size * 100);
-                    }
-                    else {
-                        // No data length, end of data
-                        expecting_data = 0;
-                        offset += data_received;
-                        break;
-                    }
-                }
+        // Forget ports that went away (a replugged module comes back as new).
+        // A port that appeared is probed from the next scan on: a unit whose
+        // module re-enumerated reopens it well within that (and its own port
+        // is never probed while it runs).
+        int n = serial_port_names(now, SERIAL_MAX_PORTS);
+        int nfresh_next = 0;
+        for (int i = 0; i < nknown; ++i) {
+            int present = 0;
+            for (int j = 0; j < n && !present; ++j) present = _stricmp(known[i], now[j]) == 0;
+            if (!present) {
+                memmove(known[i], known[i + 1], (nknown - i - 1) * sizeof(known[0]));
+                nknown--;
+                i--;
             }
-            else if (strstr(line, "ERROR") != NULL) {
-                printf("Download error\n");
-                fclose(file);
-                return 0;
+        }
+        for (int j = 0; j < n && nknown < SERIAL_MAX_PORTS; ++j) {
+            int seen = 0;
+            int settled = 0;
+            for (int i = 0; i < nknown && !seen; ++i) seen = _stricmp(known[i], now[j]) == 0;
+            for (int i = 0; i < WATCH_MAX_TASKS && !seen; ++i) {
+                seen = w.units[i].state != UNIT_FREE && _stricmp(w.units[i].run.port, now[j]) == 0;
+            }
+            if (seen) continue;
+            for (int i = 0; i < nfresh && !settled; ++i) settled = _stricmp(fresh[i], now[j]) == 0;
+            if (!settled) {
+                snprintf(fresh_next[nfresh_next++], sizeof(fresh[0]), "%s", now[j]);
+                continue;
+            }
+            WatchUnit* u = NULL;
+            for (int i = 0; i < WATCH_MAX_TASKS && !u; ++i) {
+                if (w.units[i].state == UNIT_FREE) u = &w.units[i];
             }
+            if (!u) break;      // all slots taken; the port is picked up when one frees
+            memset(u, 0, sizeof(*u));
+            u->run = w.templ;
+            snprintf(u->run.port, sizeof(u->run.port), "%s", now[j]);
+            u->state = UNIT_QUEUED;
+            watch_push(&w.workers[next_worker++ % w.nworkers], u);
+            snprintf(known[nknown++], sizeof(known[0]), "%s", now[j]);
         }
+        memcpy(fresh, fresh_next, nfresh_next * sizeof(fresh[0]));
+        nfresh = nfresh_next;
+
+        // Woken at once by an arrival notification, else poll
+        if (arrival) WaitForSingleObject(arrival, WATCH_POLL_MS);
+        else Sleep(WATCH_POLL_MS);
     }
 
-    fclose(file);
-    printf("File download complete, total size: %d bytes\n", bytes_received);
-    return 1;
+    InterlockedExchange(&w.shutdown, 1);
+    for (int i = 0; i < w.nworkers; ++i) {
+        WaitForSingleObject(w.workers[i].thread, INFINITE);
+        CloseHandle(w.workers[i].thread);
+        DeleteCriticalSection(&w.workers[i].lock);
+    }
+    g_fleet = NULL;
+    port_arrival_unwatch(notify);
+    if (arrival) CloseHandle(arrival);
+    CloseHandle(w.work);
+    SetConsoleCtrlHandler(watch_ctrl_handler, FALSE);
+    DeleteCriticalSection(&w.lock);
+    if (jobs_path) job_store_close();
+    printf("\nWatch: %d module(s) updated, %d failed\n", passed, failed);
+    for (int r = 0; r < FLEET_RESOURCES; ++r) {
+        FleetResource* res = &fleet.res[r];
+        int best = 0;
+        for (int k = 1; k <= fleet.max_limit; ++k) {
+            if (res->rate[k] > res->rate[best]) best = k;
+        }
+        if (best) {
+            printf("  %-8s limit %d, best %.1f KB/s with %d at once\n", fleet_resource_names[r], res->limit,
+                res->rate[best] / 1024.0, best);
+        }
+        else {
+            printf("  %-8s limit %d (not measured)\n", fleet_resource_names[r], res->limit);
+        }
+    }
+    DeleteCriticalSection(&fleet.lock);
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char** argv) {
-    SerialPort serial;
-    RingBuffer rxBuffer;
-    HANDLE hThread;
-    char input[100];
-    int file_size = 0;
+    DeviceRun run;
+
+    if (argc >= 2 && strcmp(argv[1], "speedtest") == 0) {
+        return run_speedtest(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "tune") == 0) {
+        return run_tune(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0) {
+        return run_batch(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "watch") == 0) {
+        return run_watch(argc, argv);
+    }
+    if (argc >= 3 && strcmp(argv[1], "decode-log") == 0) {
+        return alog_decode(argv[2], stdout) ? 0 : 1;
+    }
 
     // Command-line parameters (positional): <COM> <HTTP_URL> <LOCAL_FILENAME> [BAUD]
-    char portName[20] = { 0 };
-    char http_url[260] = { 0 };
+    char portName[128] = { 0 };
+    char url_input[4096] = { 0 };
+    const char* http_url = url_input;   // argv or interactive input, never copied
     char http_filename[100] = { 0 };
     int baudRate = 115200; // default baud rate
+    const char* trace_path = NULL;
+    const char* log_path = NULL;
+    int log_format = ALOG_TEXT;
+    int metrics_port = 0;
+    const char* metrics_json = NULL;
+    MetricsExporter exporter;
+    const char* report_path = NULL;
+    int low_latency = 0;
+    int pace = -1;          // --pace: starting LFOTA pace in bytes/s, 0 = unpaced
+    int pace_gap = -1;
+    const char* jobs_path = NULL;
+
+    // Options (--name value) may appear anywhere; everything else is positional.
+    const char* positional[4] = { 0 };
+    int npos = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--metrics-json") == 0 && i + 1 < argc) {
+            metrics_json = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            int level = log_level_from_name(argv[++i]);
+            if (level < 0) {
+                printf("Unknown log level '%s' (quiet, progress, protocol, hexdump)\n", argv[i]);
+                return 1;
+            }
+            g_log_level = level;
+        }
+        else if (strcmp(argv[i], "--hexdump-bytes") == 0 && i + 1 < argc) {
+            g_hexdump_bytes = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+            report_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profiles") == 0 && i + 1 < argc) {
+            g_profile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--low-latency") == 0) {
+            low_latency = 1;
+        }
+        else if (strcmp(argv[i], "--rx-priority") == 0 || strcmp(argv[i], "--rx-cpu") == 0) {
+            if (rx_placement_option(argc, argv, &i) < 0) return 1;
+        }
+        else if (strcmp(argv[i], "--pace") == 0 && i + 1 < argc) {
+            pace = atoi(argv[++i]);
+            if (pace < 0) pace = 0;
+        }
+        else if (strcmp(argv[i], "--pace-gap") == 0 && i + 1 < argc) {
+            pace_gap = atoi(argv[++i]);
+            if (pace_gap < 0) pace_gap = 0;
+        }
+        else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            log_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log-format") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "json") == 0) log_format = ALOG_JSON;
+            else if (strcmp(argv[i], "raw") == 0) log_format = ALOG_RAW;
+            else log_format = ALOG_TEXT;
+        }
+        else if (npos < 4) {
+            positional[npos++] = argv[i];
+        }
+    }
 
     // Accept partial CLI inputs; fall back to interactive prompts for missing values.
-    if (argc >= 2) {
-        snprintf(portName, sizeof(portName), "%s", argv[1]);
+    if (npos >= 1) {
+        snprintf(portName, sizeof(portName), "%s", positional[0]);
     }
-    if (argc >= 3) {
-        snprintf(http_url, sizeof(http_url), "%s", argv[2]);
+    if (npos >= 2) {
+        http_url = positional[1];
     }
-    if (argc >= 4) {
-        snprintf(http_filename, sizeof(http_filename), "%s", argv[3]);
+    if (npos >= 3) {
+        snprintf(http_filename, sizeof(http_filename), "%s", positional[2]);
     }
-    if (argc >= 5) {
-        int b = atoi(argv[4]);
+    if (npos >= 4) {
+        int b = atoi(positional[3]);
         if (b > 0) baudRate = b;
     }
+    int baud_given = npos >= 4;
 
     // If any required value is missing, prompt interactively. Also prompt for baud if not given.
     if (portName[0] == '\0' || http_url[0] == '\0' || http_filename[0] == '\0') {
@@ -610,8 +5752,8 @@ int main(int argc, char** argv) {
 
         if (http_url[0] == '\0') {
             printf("Enter HTTP URL to download from (e.g., http://example.com/file.txt): ");
-            fgets(http_url, sizeof(http_url), stdin);
-            http_url[strcspn(http_url, "\r\n")] = 0;
+            fgets(url_input, sizeof(url_input), stdin);
+            url_input[strcspn(url_input, "\r\n")] = 0;
         }
 
         if (http_filename[0] == '\0') {
@@ -621,7 +5763,7 @@ int main(int argc, char** argv) {
         }
 
         // If baud was not supplied on CLI, ask the user (allow empty to keep default)
-        if (argc < 5) {
+        if (npos < 4) {
             char baud_input[32] = { 0 };
             printf("Enter baud rate (e.g., 115200) [default %d]: ", baudRate);
             fgets(baud_input, sizeof(baud_input), stdin);
@@ -629,348 +5771,222 @@ int main(int argc, char** argv) {
             if (baud_input[0] != '\0') {
                 int b = atoi(baud_input);
                 if (b > 0) baudRate = b;
+                baud_given = 1;
             }
         }
     }
 
-    printf("=== SIMCOM HTTP File Download Tool ===\n\n");
-
-    // Initialize ring buffer
-    ring_buffer_init(&rxBuffer);
-    // Open serial port
-    // If no baud was provided on the command line, allow the user to enter it now
-    printf("Opening serial port %s at %d baud...\n", portName, baudRate);
-    serial.hCom = open_serial_port(portName, baudRate);
-    serial.rxBuffer = &rxBuffer;
-
-    if (serial.hCom == INVALID_HANDLE_VALUE) {
-        printf("Unable to open serial port %s\n", portName);
-        return 1;
-    }
-
-    printf("Serial port opened successfully\n");
-
-    // Start receiver thread
-    serial.running = 1;
-    hThread = CreateThread(NULL, 0, serial_receive_thread, &serial, 0, NULL);
-    if (hThread == NULL) {
-        printf("Unable to create receiver thread\n");
-        CloseHandle(serial.hCom);
+    // A job log from an interrupted run says where to pick this device up
+    if (jobs_path && !job_store_open(jobs_path)) {
+        printf("Unable to use job store %s\n", jobs_path);
         return 1;
     }
 
-    // Execute AT command sequence
-    printf("\nStarting AT command sequence...\n");
-
-    // 1. Send AT
-    printf("\n1. Sending AT command...\n");
-    if (!send_at_command(serial.hCom, "AT") || !wait_for_response(&rxBuffer, "OK", 1000)) {
-        printf("AT command failed\n");
-        goto cleanup;
-    }
-
-    // After basic AT OK, query firmware version and subscribe (CGMR then CSUB)
-    printf("\n1a. Querying firmware version (AT+CGMR)...\n");
-    if (!send_at_command(serial.hCom, "AT+CGMR") || !wait_for_response(&rxBuffer, "OK", 2000)) {
-        printf("AT+CGMR failed or no OK\n");
-        goto cleanup;
-    }
+    log_printf(LOG_PROGRESS, "=== SIMCOM HTTP File Download Tool ===\n\n");
+    PROBES_REGISTER();
 
-    printf("\n1b. Sending AT+CSUB...\n");
-    if (!send_at_command(serial.hCom, "AT+CSUB") || !wait_for_response(&rxBuffer, "OK", 2000)) {
-        printf("AT+CSUB failed or no OK\n");
-        goto cleanup;
+    if (trace_path) {
+        trace_init();
+        trace_thread_name("main");
+        log_printf(LOG_PROGRESS, "Recording protocol trace to %s\n", trace_path);
     }
 
-    // 2. Send AT+HTTPINIT
-    printf("\n2. Starting HTTP service...\n");
-    if (!send_at_command(serial.hCom, "AT+HTTPINIT") || !wait_for_response(&rxBuffer, "OK", 5000)) {
-        printf("Failed to start HTTP service\n");
-        goto cleanup;
+    if (log_path && alog_start(log_path, log_format)) {
+        log_printf(LOG_PROGRESS, "Protocol log goes to %s\n", log_path);
     }
 
-    // 3. Send AT+HTTPPARA="SSLCFG",1
-    printf("\n3. Set SSL configuration...\n");
-    if (!send_at_command(serial.hCom, "AT+HTTPPARA=\"SSLCFG\",1") || !wait_for_response(&rxBuffer, "OK", 5000)) {
-        printf("Failed to set SSL configuration\n");
-        goto cleanup;
+    if ((metrics_port > 0 || metrics_json) && !metrics_exporter_start(&exporter, metrics_port, metrics_json)) {
+        printf("Unable to start metrics endpoint on port %d\n", metrics_port);
     }
 
-    // 4. Send URL
-    printf("\n4. Logging into HTTP server...\n");
-    {
-        char loginCmd[512];
-        // Construct login command using HTTP parameters from CLI or interactive input
-        sprintf_s(loginCmd, sizeof(loginCmd), "AT+HTTPPARA=\"URL\",\"%s\"", http_url);
-        if (!send_at_command(serial.hCom, loginCmd) || !wait_for_response(&rxBuffer, "OK", 1000)) {
-            printf("HTTP login failed\n");
-            goto cleanup;
-        }
-    }
+    memset(&run, 0, sizeof(run));
+    snprintf(run.port, sizeof(run.port), "%s", portName);
+    run.url = http_url;
+    snprintf(run.filename, sizeof(run.filename), "%s", http_filename);
+    run.baud = baudRate;
+    run.baud_given = baud_given;
+    run.low_latency = low_latency;
+    run.pace = pace;
+    run.pace_gap = pace_gap;
+    run.report_path = report_path;
+    run.job_key = jobs_path ? portName : NULL;
+    run_device(&run);
 
-    // 5. Set AT+HTTPACTION
-    printf("\n5. Set AT+HTTPACTION...\n");
-    if (!send_at_command(serial.hCom, "AT+HTTPACTION=0") || !wait_for_response(&rxBuffer, "+HTTPACTION: 0,200", 10000)) {
-        printf("Failed to set AT+HTTPACTION\n");
-        goto cleanup;
+    if (trace_path) {
+        trace_write(trace_path);
     }
-
-    // 6. Get file size 
-    printf("\n6. Get file size...\n");
-    char httphead_command[16];
-    // Use filename from CLI or interactive input
-    sprintf_s(httphead_command, sizeof(httphead_command), "AT+HTTPHEAD");
-    if (!send_at_command(serial.hCom, httphead_command) ||
-        !parse_number_response(&rxBuffer, "Content-Length: ", &file_size, 1000)) {
-        printf("Failed to get file size\n");
-        goto cleanup;
+    if (metrics_port > 0 || metrics_json) {
+        metrics_exporter_stop(&exporter);
     }
-    printf("Total file size: %d bytes\n", file_size);
+    PROBES_UNREGISTER();
+    alog_stop();
+    if (jobs_path) job_store_close();
 
-    if(!wait_for_response(&rxBuffer, "OK", 1000)) {
-        printf("Failed to complete HTTPHEAD command\n");
-        goto cleanup;
-    }
+    return run.ok ? 0 : 1;
+}
 
-    // 7. Download file
-    printf("\n7. Start downloading file...\n");
-    if (!download_file_data(serial.hCom, &rxBuffer, http_filename, file_size)) {
-        printf("File download failed\n");
-        goto cleanup;
-    }
+// Token bucket for paced writes: 'rate' bytes/s, at most 'burst' bytes at once.
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    LONGLONG last_us;
+} TokenBucket;
 
-    // After successful download, perform LFOTA upload sequence:
-    // 1) Terminate HTTP
-    printf("\n8. Terminating HTTP service...\n");
-    if (!send_at_command(serial.hCom, "AT+HTTPTERM") || !wait_for_response(&rxBuffer, "OK", 5000)) {
-        printf("AT+HTTPTERM failed\n");
-        goto cleanup;
-    }
+void bucket_init(TokenBucket* b, int rate, int burst) {
+    b->rate = (double)rate;
+    b->burst = (double)burst;
+    b->tokens = (double)burst;
+    b->last_us = mono_now_us();
+}
 
-    // 2) Notify module of incoming LFOTA size: AT+LFOTA=0,size
-    {
-        char lfota_cmd[64];
-        sprintf_s(lfota_cmd, sizeof(lfota_cmd), "AT+LFOTA=0,%d", file_size);
-        printf("Sending: %s\n", lfota_cmd);
-        if (!send_at_command(serial.hCom, lfota_cmd) || !wait_for_response(&rxBuffer, "OK", 5000)) {
-            printf("AT+LFOTA=0 failed\n");
-            goto cleanup;
+// Block until 'n' bytes (n <= burst) may be sent.
+void bucket_take(TokenBucket* b, int n) {
+    while (1) {
+        LONGLONG now = mono_now_us();
+        b->tokens += (double)(now - b->last_us) * b->rate / 1000000.0;
+        if (b->tokens > b->burst) b->tokens = b->burst;
+        b->last_us = now;
+        if (b->tokens >= (double)n) {
+            b->tokens -= (double)n;
+            return;
         }
+        poll_sleep((DWORD)(((double)n - b->tokens) * 1000.0 / b->rate) + 1);
     }
+}
 
-    // 3) Request to start LFOTA transfer: AT+LFOTA=1,size -> expect '>' prompt
-    {
-        char lfota_cmd[64];
-        sprintf_s(lfota_cmd, sizeof(lfota_cmd), "AT+LFOTA=1,%d", file_size);
-        printf("Sending: %s\n", lfota_cmd);
-        if (!send_at_command(serial.hCom, lfota_cmd)) {
-            printf("Failed to send AT+LFOTA=1 command\n");
-            goto cleanup;
-        }
-
-        // Wait for '>' prompt indicating module is ready to receive binary data
-        if (!wait_for_response(&rxBuffer, ">", 10000)) {
-            printf("Did not receive '>' prompt for LFOTA data\n");
-            goto cleanup;
-        }
-
-        // 4) Send entire file in a single write (more efficient than 1KB chunks)
-        printf("Starting LFOTA upload of %d bytes (single write)...\n", file_size);
-        FILE* f = NULL;
-        if (fopen_s(&f, http_filename, "rb") != 0) {
-            printf("Unable to open file for LFOTA: %s\n", http_filename);
-            goto cleanup;
-        }
-
-        // Allocate buffer for whole file
-        char* sendbuf_all = (char*)malloc((size_t)file_size);
-        if (!sendbuf_all) {
-            fclose(f);
-            printf("Failed to allocate memory for LFOTA upload (%d bytes)\n", file_size);
-            goto cleanup;
-        }
-
-        size_t total_read = fread(sendbuf_all, 1, (size_t)file_size, f);
-        if ((int)total_read != file_size) {
-            free(sendbuf_all);
-            fclose(f);
-            printf("Failed to read entire file for LFOTA (read %zu of %d)\n", total_read, file_size);
-            goto cleanup;
-        }
-
-        // Use helper to write and drain the serial output queue
-        int write_and_drain(HANDLE hCom, const char* buf, DWORD len, DWORD write_timeout_ms, DWORD drain_timeout_ms);
-        printf("WriteFile (single) -> write_and_drain...\n");
-        if (!write_and_drain(serial.hCom, sendbuf_all, (DWORD)total_read, 30000, 30000)) {
-            free(sendbuf_all);
-            fclose(f);
-            printf("LFOTA single write or drain failed\n");
-            goto cleanup;
-        }
-
-        // cleanup buffer and file
-        free(sendbuf_all);
-        fclose(f);
-
-        // 5) After data sent, wait for final OK from module
-        if (!wait_for_response(&rxBuffer, "OK", 20000)) {
-            printf("LFOTA transfer did not complete (no OK)\n");
-            goto cleanup;
-        }
-
-        // 6) Reboot module and monitor CFOTA progress
-        printf("Sending AT+CRESET to reboot module...\n");
-        if (!send_at_command(serial.hCom, "AT+CRESET")) {
-            printf("Failed to send AT+CRESET\n");
-            goto cleanup;
-        }
-
-        // Monitor module reports: +CFOTA: UPDATE:<process> and +CFOTA: UPDATE SUCCESS, then QCRDY
-        printf("Waiting for CFOTA progress and completion (this may take several minutes)...\n");
-        int got_update_success = 0;
-        int got_qcrdy = 0;
-        int last_progress = -1;
-        char cfota_line[256];
-        DWORD cfota_start = GetTickCount();
-        const DWORD CFOTA_OVERALL_TIMEOUT_MS = 10 * 60 * 1000; // 10 minutes
-
-        while (!got_qcrdy && (GetTickCount() - cfota_start) < CFOTA_OVERALL_TIMEOUT_MS) {
-            if (read_line_from_buffer(&rxBuffer, cfota_line, sizeof(cfota_line))) {
-                printf("Received: %s", cfota_line);
-
-                // Check for progress lines like: +CFOTA: UPDATE:<n>
-                const char* p = strstr(cfota_line, "+CFOTA: UPDATE:");
-                if (p) {
-                    p += strlen("+CFOTA: UPDATE:");
-                    while (*p && !isdigit((unsigned char)*p)) p++;
-                    if (*p) {
-                        int v = atoi(p);
-                        if (v != last_progress) {
-                            last_progress = v;
-                            printf("CFOTA progress: %d\n", v);
-                        }
-                        if (v >= 100) {
-                            // progress indicates finished; wait for explicit SUCCESS message
-                        }
-                    }
-                    continue;
-                }
-
-                // Check for explicit success message
-                if (strstr(cfota_line, "+CFOTA: UPDATE SUCCESS") != NULL) {
-                    got_update_success = 1;
-                    printf("CFOTA update reported SUCCESS\n");
-                    continue;
-                }
-
-                // Check for QCRDY (module ready after reboot/update)
-                if (strstr(cfota_line, "QCRDY") != NULL) {
-                    got_qcrdy = 1;
-                    printf("Module reported QCRDY\n");
-                    break;
-                }
-            }
-            else {
-                Sleep(200);
-            }
-        }
-
-        if (!got_update_success) {
-            printf("Did not observe CFOTA UPDATE SUCCESS within timeout\n");
-            goto cleanup;
-        }
-        if (!got_qcrdy) {
-            printf("Did not observe QCRDY within timeout\n");
-            goto cleanup;
-        }
-
-        // After QCRDY, wait a short time, then query firmware and subscribe
-        Sleep(2000);
-        printf("Querying firmware version after update (AT+CGMR)...\n");
-        if (!send_at_command(serial.hCom, "AT+CGMR") || !wait_for_response(&rxBuffer, "OK", 5000)) {
-            printf("AT+CGMR failed or no OK after update\n");
-            goto cleanup;
-        }
-
-        printf("Sending AT+CSUB after update...\n");
-        if (!send_at_command(serial.hCom, "AT+CSUB") || !wait_for_response(&rxBuffer, "OK", 5000)) {
-            printf("AT+CSUB failed or no OK after update\n");
-            goto cleanup;
-        }
-
-        
+// Stream 'len' bytes from 'src' to the port through two session blocks:
+// while one overlapped write is on the wire the next block is read from
+// disk, so the UART never idles and the image is never held in memory.
+// Without RTS/CTS and with a pace set, blocks shrink to ~20 ms of data and
+// go out through a token bucket, plus the profile's inter-block gap.
+// Then wait for the driver's output queue to drain; a network port has no
+// visible queue, so there the module's final OK is the only confirmation.
+// Returns 1 on success.
+int write_and_drain(HANDLE hCom, FILE* src, long long len, DWORD write_timeout_ms, DWORD drain_timeout_ms,
+    Progress* progress, TransferStats* stats) {
+    SessionArena* arena = arena_current();
+    int block_size = g_profile.upload_block;
+    if (block_size > ARENA_BLOCK_SIZE) block_size = ARENA_BLOCK_SIZE;
+    NetLink* net = net_link(hCom);
+    int escaped = net && net->kind == NET_RFC2217;
+    int alloc_size = block_size;
+    if (escaped && block_size > ARENA_BLOCK_SIZE / 2) block_size = ARENA_BLOCK_SIZE / 2; // room to double IACs
+    int paced = !g_profile.rtscts && g_profile.pace_bps > 0;
+    TokenBucket bucket;
+    if (paced) {
+        int paced_block = g_profile.pace_bps / PACE_BLOCKS_PER_S;
+        if (paced_block < PACE_MIN_BLOCK) paced_block = PACE_MIN_BLOCK;
+        if (paced_block < block_size) block_size = paced_block;
+        bucket_init(&bucket, g_profile.pace_bps, block_size);
     }
+    if (escaped) alloc_size = block_size * 2;
+    char* block[2] = { arena_block_get(arena, alloc_size), arena_block_get(arena, alloc_size) };
+    OVERLAPPED ov[2];
+    int pending[2] = { 0, 0 };
+    DWORD issued[2] = { 0, 0 };     // bytes handed to WriteFile
+    DWORD payload[2] = { 0, 0 };    // image bytes they carry
+    long long sent = 0;
+    long long written = 0;
+    int next = 0;
+    int ok = 0;
+    Timer deadline;
+    LONGLONG write_start = mono_now_us();
+    LONGLONG drain_start;
 
-    printf("\n=== All operations completed ===\n");
-
-cleanup:
-    // Cleanup resources
-    serial.running = 0;
-    WaitForSingleObject(hThread, 1000);
-    CloseHandle(hThread);
-    CloseHandle(serial.hCom);
-    DeleteCriticalSection(&rxBuffer.lock);
-
-    return 0;
-}
-
-// Write buffer with overlapped I/O, wait for completion and drain the driver's output queue.
-// Returns 1 on success, 0 on failure.
-int write_and_drain(HANDLE hCom, const char* buf, DWORD len, DWORD write_timeout_ms, DWORD drain_timeout_ms) {
-    OVERLAPPED ov = { 0 };
-    ov.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // auto-reset event
-    if (!ov.hEvent) return 0;
+    memset(ov, 0, sizeof(ov));
+    ov[0].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ov[1].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    deadline_start(&deadline, write_timeout_ms);
+    if (!block[0] || !block[1] || !ov[0].hEvent || !ov[1].hEvent) goto done;
 
-    DWORD bytesWritten = 0;
-    BOOL ok = WriteFile(hCom, buf, len, &bytesWritten, &ov);
-    if (!ok) {
-        DWORD err = GetLastError();
-        if (err == ERROR_IO_PENDING) {
-            DWORD wait = WaitForSingleObject(ov.hEvent, write_timeout_ms);
-            if (wait == WAIT_OBJECT_0) {
-                if (!GetOverlappedResult(hCom, &ov, &bytesWritten, FALSE)) {
-                    CloseHandle(ov.hEvent);
-                    return 0;
-                }
+    while (written < len) {
+        // Refill the free block and put it on the wire
+        if (!pending[next] && sent < len) {
+            DWORD n = len - sent < block_size ? (DWORD)(len - sent) : (DWORD)block_size;
+            LONGLONG read_start = mono_now_us();
+            if (fread(block[next], 1, n, src) != n) {
+                printf("Failed to read file for upload at offset %lld\n", sent);
+                goto done;
             }
-            else {
-                // timeout or error: cancel this overlapped I/O
-                // Prefer CancelIoEx if available
-                CancelIoEx(hCom, &ov);
-                CloseHandle(ov.hEvent);
-                return 0;
+            if (stats) stats->consumer_us += mono_now_us() - read_start;
+            if (paced) {
+                if (sent > 0 && g_profile.pace_gap_ms > 0) poll_sleep((DWORD)g_profile.pace_gap_ms);
+                bucket_take(&bucket, (int)n);
             }
+            DWORD wire = escaped ? net_escape(block[next], n) : n;
+            ResetEvent(ov[next].hEvent);
+            if (!WriteFile(hCom, block[next], wire, NULL, &ov[next]) && GetLastError() != ERROR_IO_PENDING) {
+                goto done;
+            }
+            pending[next] = 1;
+            issued[next] = wire;
+            payload[next] = n;
+            sent += n;
+            next ^= 1;
+            continue;
         }
-        else {
-            CloseHandle(ov.hEvent);
-            return 0;
+
+        // Both blocks in flight (or nothing left to read): wait for the older one
+        int j = pending[next] ? next : next ^ 1;
+        DWORD slice = progress ? 100 : deadline_remaining_ms(&deadline);
+        DWORD wait = WaitForSingleObject(ov[j].hEvent, slice);
+        if (wait == WAIT_TIMEOUT) {
+            if (deadline_expired(&deadline)) goto done;
+            progress_from_out_queue(hCom, progress, sent);
+            continue;
         }
+        DWORD bytesWritten = 0;
+        if (wait != WAIT_OBJECT_0 || !GetOverlappedResult(hCom, &ov[j], &bytesWritten, FALSE)) goto done;
+        pending[j] = 0;
+        if (bytesWritten != issued[j]) goto done; // partial write
+        written += payload[j];
+        job_checkpoint(written, NULL);
+        metrics_add(MET_TX_BYTES, bytesWritten);
+        deadline_restart(&deadline, write_timeout_ms);
+        if (net && progress) progress_update(progress, written);
+        else progress_from_out_queue(hCom, progress, sent);
     }
-
-    if (bytesWritten != len) {
-        // Partial write
-        CloseHandle(ov.hEvent);
-        return 0;
+    trace_span("lfota", "write", write_start, written, NULL);
+    if (net) {
+        ok = 1;
+        goto done;
     }
 
     // Now wait for driver's output queue to drain
-    DWORD start = GetTickCount();
+    drain_start = mono_now_us();
+    deadline_restart(&deadline, drain_timeout_ms);
     while (1) {
         COMSTAT comStat;
         DWORD errors = 0;
-        if (!ClearCommError(hCom, &errors, &comStat)) {
-            CloseHandle(ov.hEvent);
-            return 0;
-        }
+        if (!ClearCommError(hCom, &errors, &comStat)) break;
+        if (progress && (long long)comStat.cbOutQue <= len) progress_update(progress, len - comStat.cbOutQue);
         if (comStat.cbOutQue == 0) {
-            CloseHandle(ov.hEvent);
-            return 1; // success
+            trace_span("lfota", "drain", drain_start, -1, NULL);
+            PROBE_DRAIN_COMPLETE(len, mono_now_us() - drain_start);
+            alog_event(EV_DRAIN_COMPLETE, len, mono_now_us() - drain_start, NULL, 0);
+            ok = 1;
+            break;
         }
-        if ((GetTickCount() - start) > drain_timeout_ms) {
+        if (deadline_expired(&deadline)) {
             // timed out waiting for drain
-            CloseHandle(ov.hEvent);
-            return 0;
+            trace_span("lfota", "drain", drain_start, (long long)comStat.cbOutQue, "timeout");
+            break;
         }
-        Sleep(10);
+        poll_sleep(10);
     }
-}
\ No newline at end of file
+
+done:
+    // Never hand a block back while the driver may still be reading it
+    for (int k = 0; k < 2; ++k) {
+        if (pending[k]) {
+            DWORD ignored = 0;
+            try_cancel_overlapped(hCom, &ov[k]);
+            GetOverlappedResult(hCom, &ov[k], &ignored, TRUE);
+        }
+        if (ov[k].hEvent) CloseHandle(ov[k].hEvent);
+        arena_block_put(arena, block[k]);
+    }
+    deadline_cancel(&deadline);
+    return ok;
+}